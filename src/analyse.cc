@@ -18,6 +18,7 @@
 #include <cstdio>
 #include <cfloat>
 #include <iomanip>
+#include <iterator>
 #include <unistd.h>
 #include <sstream>
 #include <cassert>
@@ -265,9 +266,11 @@ const char USAGE[] = "igprof-analyse\n"
     "  [-mr/--merge-regexp REGEXP]\n"
     "  [-ml/--merge-libraries REGEXP]\n"
     "  [-nf/--no-filter]\n"
-    "  { [-t/--text], [-s/--sqlite], [--top <n>], [--tree] }\n"
+    "  { [-t/--text], [-s/--sqlite], [--top <n>], [--tree], [-cl/--cpu-load],\n"
+    "    [-tl/--timeline] }\n"
     "  [--libs] [--demangle] [--gdb] [-v/--verbose]\n"
     "  [-b/--baseline FILE [--diff-mode]]\n"
+    "  [--ratio KEY] [--ipc]\n"
     "  [-Mc/--max-count-value <value>] [-mc/--min-count-value <value>]\n"
     "  [-Mf/--max-calls-value <value>] [-mc/--min-calls-value <value>]\n"
     "  [-Ma/--max-average-value <value>] [-ma/--min-average-value <value>]\n"
@@ -730,6 +733,26 @@ public:
       return m_diffMode;
     }
 
+  void setRatio(const std::string &ratio)
+    {
+      m_ratio = ratio;
+    }
+
+  const std::string &ratio(void)
+    {
+      return m_ratio;
+    }
+
+  void setRatioFactor(bool value)
+    {
+      m_ratioFactor = value;
+    }
+
+  bool ratioFactor(void)
+    {
+      return m_ratioFactor;
+    }
+
   bool hasHitFilter(void)
     {
       return minCountValue > 0
@@ -754,6 +777,8 @@ private:
   bool m_mergeLibraries;
   std::string m_baseline;
   bool m_diffMode;
+  std::string m_ratio;
+  bool m_ratioFactor;
 public:
   int64_t  minCountValue;
   int64_t  maxCountValue;
@@ -764,6 +789,8 @@ public:
   bool     tree;
   bool     useGdb;
   bool     dumpAllocations;
+  bool     cpuLoad;
+  bool     timeline;
   std::vector<RegexpSpec>   regexps;
   AncestorsSpec  ancestors;
 };
@@ -780,6 +807,7 @@ Configuration::Configuration()
    m_normalValue(true),
    m_mergeLibraries(false),
    m_diffMode(false),
+   m_ratioFactor(false),
    minCountValue(-1),
    maxCountValue(-1),
    minCallsValue(-1),
@@ -788,7 +816,9 @@ Configuration::Configuration()
    maxAverageValue(-1),
    tree(false),
    useGdb(false),
-   dumpAllocations(false)
+   dumpAllocations(false),
+   cpuLoad(false),
+   timeline(false)
 {}
 
 static Configuration *s_config = 0;
@@ -1081,7 +1111,8 @@ public:
 
   void run(void);
   void parseArgs(const ArgsList &args);
-  void analyse(ProfileInfo &prof, TreeMapBuilderFilter *baselineBuilder);
+  void analyse(ProfileInfo &prof, TreeMapBuilderFilter *baselineBuilder,
+               TreeMapBuilderFilter *ratioBuilder);
   void generateFlatReport(ProfileInfo &prof,
                           TreeMapBuilderFilter *callTreeBuilder,
                           TreeMapBuilderFilter *baselineBuilder,
@@ -1091,6 +1122,8 @@ public:
   void tree(ProfileInfo &prof);
   void readDump(ProfileInfo *prof, const std::string &filename, StackTraceFilter *filter);
   void dumpAllocations(ProfileInfo &prof);
+  void cpuLoad(ProfileInfo &prof);
+  void timeline(void);
   void prepdata(ProfileInfo &prof);
   void summarizePageInfo(FlatVector &sorted);
 
@@ -1108,7 +1141,7 @@ public:
 
     if (strstr(m_key.c_str(), "_MAX") == m_key.c_str() + m_key.size() - 4)
       m_keyMax = true;
-    if (m_key == "PERF_TICKS" || m_key.find("NRG_") == 0)
+    if (m_key == "PERF_TICKS" || m_key == "WALL_TICKS" || m_key.find("NRG_") == 0)
       m_isPerfTicks = true;
 
     if (m_disableFilters)
@@ -1140,6 +1173,7 @@ private:
   bool                          m_showLocalityMetrics;
   size_t                        m_topN;
   float                         m_tickPeriod;
+  std::map<SymbolInfo *, FlatInfo *> m_ratios;
 };
 
 
@@ -1838,6 +1872,104 @@ protected:
   }
 };
 
+/** Names of functions in dynamically generated code.  Just-in-time
+    compilers describe the code they generate for perf in a perf map
+    "/tmp/perf-PID.map" and in a jitdump file "jit-PID.dump", which
+    are read here to name the code which the profiled process could not
+    name itself, for example because the map was only written at exit.
+    The jitdump file is looked for in the current directory and /tmp.
+  */
+class JitSymbols
+{
+public:
+  void load(int64_t pid)
+    {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "/tmp/perf-%" PRId64 ".map", pid);
+      loadPerfMap(buf);
+      snprintf(buf, sizeof(buf), "jit-%" PRId64 ".dump", pid);
+      if (! loadJitDump(buf))
+        loadJitDump(std::string("/tmp/") + buf);
+    }
+
+  /** Replace @a symname by the name of the generated function covering
+      @a address.  The offset into the function is not kept, so that all
+      the addresses in it merge into one symbol.  Returns false if no
+      generated function covers the address.  */
+  bool lookup(uint64_t address, std::string &symname)
+    {
+      Symbols::iterator i = m_symbols.upper_bound(address);
+      if (i == m_symbols.begin())
+        return false;
+      --i;
+      if (address - i->first >= i->second.first)
+        return false;
+      symname = i->second.second;
+      return true;
+    }
+
+private:
+  typedef std::map<uint64_t, std::pair<uint64_t, std::string> > Symbols;
+
+  /** Read "START SIZE NAME" lines with hexadecimal start and size. */
+  void loadPerfMap(const std::string &filename)
+    {
+      std::ifstream in(filename.c_str());
+      std::string line;
+      while (std::getline(in, line))
+      {
+        char *end = 0;
+        uint64_t start = strtoull(line.c_str(), &end, 16);
+        if (*end != ' ')
+          continue;
+        uint64_t size = strtoull(end + 1, &end, 16);
+        if (*end == ' ' && size && end[1])
+          m_symbols[start] = std::make_pair(size, std::string(end + 1));
+      }
+    }
+
+  /** Read the code load records of a jitdump file in native byte order. */
+  bool loadJitDump(const std::string &filename)
+    {
+      std::ifstream in(filename.c_str(), std::ios::binary);
+      if (! in)
+        return false;
+
+      std::string data((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+      uint32_t magic, hdrsize, id, recsize;
+      if (data.size() < 40)
+        return false;
+      memcpy(&magic, &data[0], 4);
+      memcpy(&hdrsize, &data[8], 4);
+      if (magic != 0x4A695444 || hdrsize < 40)
+        return false;
+
+      for (size_t pos = hdrsize; pos + 16 <= data.size(); pos += recsize)
+      {
+        memcpy(&id, &data[pos], 4);
+        memcpy(&recsize, &data[pos + 4], 4);
+        if (recsize < 16 || recsize > data.size() - pos)
+          break;
+
+        // Code load: pid, tid, vma, code address, code size, code
+        // index, then the null-terminated name and the code.
+        if (id == 0 && recsize > 56)
+        {
+          uint64_t start, size;
+          memcpy(&start, &data[pos + 32], 8);
+          memcpy(&size, &data[pos + 40], 8);
+          size_t nameend = data.find('\0', pos + 56);
+          if (size && nameend < pos + recsize && nameend > pos + 56)
+            m_symbols[start] = std::make_pair(size, data.substr(pos + 56, nameend - pos - 56));
+        }
+      }
+      return true;
+    }
+
+  Symbols m_symbols;
+};
+
 class SymbolInfoFactory
 {
 public:
@@ -1942,11 +2074,22 @@ public:
         return insertFileInfo(fileid, abspath, useGdb);
     }
 
+  /** Read the descriptions of generated code of process @a pid. */
+  void loadJitSymbols(int64_t pid)
+    {
+      m_jitSymbols.load(pid);
+    }
+
   /**
       Creates a SymbolInfo object using the information read from @a parser.
     */
   SymbolInfo *createSymbolInfo(std::string &symname, size_t fileoff, FileInfo *file, unsigned int symid)
     {
+      // Name generated code which the profiled process could not name.
+      if (file->NAME == "<dynamically generated>"
+          && symname.compare(0, 4, "@?0x") == 0)
+        m_jitSymbols.lookup(strtoull(symname.c_str() + 2, 0, 16), symname);
+
       // Regular expressions matching the file and symbolname information.
       symlookup(file, fileoff, symname, m_useGdb);
 
@@ -2007,6 +2150,7 @@ private:
   ProfileInfo *m_prof;
   bool m_useGdb;
   std::vector<std::string>      m_paths;
+  JitSymbols                    m_jitSymbols;
 };
 
 struct SuffixOps
@@ -2405,6 +2549,72 @@ private:
   bool        m_isMax;
 };
 
+/** Breaks down the cumulative counts of each function by the cpu and
+    the NUMA node the samples were taken on, as recorded in the
+    synthetic "cpu:N" and "node:K" root frames of the performance
+    profiler.  Must run after the tree map builder has made the
+    symbols of recursive calls unique on each path, so no count is
+    added twice to the same function.  */
+class CpuLoadFilter : public IgProfFilter
+{
+public:
+  typedef std::map<int, int64_t> Loads;
+  struct FunctionLoads
+  {
+    Loads cpus;
+    Loads nodes;
+  };
+  typedef std::map<SymbolInfo *, FunctionLoads> LoadMap;
+
+  virtual void pre(NodeInfo *, NodeInfo *node)
+    {
+      assert(node);
+      int id;
+      const char *name = node->symbol()->NAME.c_str();
+      if (sscanf(name, "cpu:%d", &id) == 1)
+      {
+        m_cpus.push_back(id);
+        m_allCpus.insert(id);
+      }
+      else if (sscanf(name, "node:%d", &id) == 1)
+      {
+        m_nodes.push_back(id);
+        m_allNodes.insert(id);
+      }
+
+      FunctionLoads &loads = m_loads[node->symbol()];
+      if (!m_cpus.empty())
+        loads.cpus[m_cpus.back()] += node->COUNTER.ccnt;
+      if (!m_nodes.empty())
+        loads.nodes[m_nodes.back()] += node->COUNTER.ccnt;
+    }
+
+  virtual void post(NodeInfo *, NodeInfo *node)
+    {
+      assert(node);
+      int id;
+      const char *name = node->symbol()->NAME.c_str();
+      if (sscanf(name, "cpu:%d", &id) == 1)
+        m_cpus.pop_back();
+      else if (sscanf(name, "node:%d", &id) == 1)
+        m_nodes.pop_back();
+    }
+
+  const std::set<int> &cpus(void) const { return m_allCpus; }
+  const std::set<int> &nodes(void) const { return m_allNodes; }
+  FunctionLoads &loads(SymbolInfo *sym) { return m_loads[sym]; }
+
+  virtual std::string name() const { return "cpu load"; }
+  virtual enum FilterType type() const { return BOTH; }
+
+private:
+  std::vector<int>  m_cpus;
+  std::vector<int>  m_nodes;
+  std::set<int>     m_allCpus;
+  std::set<int>     m_allNodes;
+  LoadMap           m_loads;
+};
+
 static void
 opentemp(char *pattern, FILE *&fp)
 {
@@ -2609,7 +2819,7 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
     t.skipString("HEX ");
   }
   t.skipString("ID=");
-  t.getToken(" ");
+  int64_t pid = t.getTokenN(" ", base);
   t.skipString(" N=(");
   t.getToken(")");
   t.skipString(") T=");
@@ -2617,6 +2827,7 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
   t.skipEol();
 
   SymbolInfoFactory symbolsFactory(prof, m_config->useGdb);
+  symbolsFactory.loadJitSymbols(pid);
 
   // A vector whose i-th element specifies whether or
   // not the counter file id "i" is a key.
@@ -3176,6 +3387,11 @@ public:
       return(intptr_t)(m_info->SYMBOL);
     }
 
+  SymbolInfo *symbol()
+    {
+      return m_info->SYMBOL;
+    }
+
   intptr_t fileId()
     {
       return(intptr_t)(m_info->SYMBOL->FILE);
@@ -3211,6 +3427,47 @@ private:
 };
 
 
+/** Helper functor to print the ratio of a key counter value to the
+    value of the reference counter given with --ratio for the same
+    function, as a percentage.  Prints nothing if no reference counter
+    was requested.
+
+    @a ratios map from symbols to the reference counter information.
+
+    @a factor print the plain ratio instead of a percentage, as for
+    instructions per cycle.
+*/
+class RatioPrinter
+{
+public:
+  RatioPrinter(bool enabled, std::map<SymbolInfo *, FlatInfo *> &ratios,
+               bool factor = false)
+  :m_enabled(enabled), m_ratios(ratios), m_factor(factor)
+  {}
+
+  void operator()(GProfRow &row, int64_t value, bool self)
+  {
+    if (! m_enabled)
+      return;
+
+    std::map<SymbolInfo *, FlatInfo *>::iterator i = m_ratios.find(row.symbol());
+    int64_t ref = 0;
+    if (i != m_ratios.end())
+      ref = self ? i->second->SELF_KEY[0] : i->second->CUM_KEY[0];
+
+    if (ref && m_factor)
+      printf("%7.2f  ", static_cast<double>(value) / static_cast<double>(ref));
+    else if (ref)
+      printf("%7.1f  ", percent(value, ref));
+    else
+      printf("%7s  ", "-");
+  }
+private:
+  bool m_enabled;
+  std::map<SymbolInfo *, FlatInfo *> &m_ratios;
+  bool m_factor;
+};
+
 class OtherGProfRow : public GProfRow
 {
 public:
@@ -3477,12 +3734,15 @@ class HeaderPrinter
 {
 public:
   HeaderPrinter(bool showpaths, bool showcalls,
-                int maxval, int maxcnt, bool diffMode)
+                int maxval, int maxcnt, bool diffMode,
+                bool showratio = false, const char *rationame = "Ratio")
     :m_showPaths(showpaths),
      m_showCalls(showcalls),
      m_maxval(maxval),
      m_maxcnt(maxcnt),
-     m_diffMode(diffMode)
+     m_diffMode(diffMode),
+     m_showRatio(showratio),
+     m_ratioName(rationame)
     {}
 
   void print(const char *description, const char *kind)
@@ -3494,6 +3754,8 @@ public:
       else
         std::cout << "% total  ";
       (AlignedPrinter(m_maxval))(kind);
+      if (m_showRatio)
+        printf("%7s  ", m_ratioName);
       if (m_showCalls)
         (AlignedPrinter(m_maxcnt))("Calls");
       if (m_showPaths)
@@ -3507,6 +3769,8 @@ private:
   int  m_maxval;
   int  m_maxcnt;
   bool m_diffMode;
+  bool m_showRatio;
+  const char *m_ratioName;
 };
 
 int64_t
@@ -3707,6 +3971,333 @@ IgProfAnalyzerApplication::dumpAllocations(ProfileInfo &prof)
   generateFlatReport(prof, callTreeBuilder, 0, sorted);
 }
 
+/** Print for every function with at least 1% of the total the share
+    of its cumulative counts taken on each NUMA node and cpu, to show
+    how evenly the work of each function is spread over the cores.  */
+void
+IgProfAnalyzerApplication::cpuLoad(ProfileInfo &prof)
+{
+  prepdata(prof);
+
+  verboseMessage("Building call tree map");
+  TreeMapBuilderFilter *callTreeBuilder = new TreeMapBuilderFilter(m_keyMax, &prof);
+  walk(prof.spontaneous(), m_nodesStorage.size(), callTreeBuilder);
+  verboseMessage(0, 0, " done\n");
+
+  // Sorting flat entries
+  verboseMessage("Sorting", 0, ".\n");
+  int rank = 1;
+  FlatVector sorted;
+  FlatInfoMap *flatMap = callTreeBuilder->flatMap();
+
+  if (flatMap->empty())
+    die("Could not find any information to print.");
+
+  for (FlatInfoMap::const_iterator i = flatMap->begin();
+       i != flatMap->end();
+       i++)
+    sorted.push_back(i->second);
+
+  sort(sorted.begin(), sorted.end(), FlatInfoComparator(m_config->ordering()));
+
+  for (size_t i = 0, e = sorted.size(); i != e; ++i)
+    sorted[i]->setRank(rank++);
+
+  if (m_config->doDemangle() || m_config->useGdb)
+  {
+    verboseMessage("Resolving symbols", 0, ".\n");
+    symremap(prof, sorted, m_config->useGdb, m_config->doDemangle());
+  }
+
+  verboseMessage("Building cpu load map");
+  CpuLoadFilter *loadFilter = new CpuLoadFilter;
+  walk(prof.spontaneous(), m_nodesStorage.size(), loadFilter);
+  verboseMessage(0, 0, " done\n");
+
+  if (loadFilter->cpus().empty())
+    die("No per-cpu information found, profile with -pc / perf:cpu.");
+
+  int64_t totals = 0, totfreq = 0;
+  callTreeBuilder->getTotals(totals, totfreq);
+
+  int maxval;
+  if (m_isPerfTicks)
+    maxval = max(8, thousands(static_cast<double>(totals) * m_tickPeriod, 0, 2).size());
+  else
+    maxval = max(8, thousands(totals).size());
+
+  std::cout << "Counter: " << m_key << "\n"
+            << "\n" << std::string(70, '-') << "\n"
+            << "Load by node and cpu, in % of each function's total (cumulative >= 1%)\n\n"
+            << "% total  ";
+  (AlignedPrinter(maxval))("Total");
+  std::set<int>::const_iterator ci;
+  for (ci = loadFilter->nodes().begin(); ci != loadFilter->nodes().end(); ++ci)
+    printf("%7s  ", ("node:" + toString(*ci)).c_str());
+  for (ci = loadFilter->cpus().begin(); ci != loadFilter->cpus().end(); ++ci)
+    printf("%7s  ", ("cpu:" + toString(*ci)).c_str());
+  std::cout << "Function\n";
+
+  for (size_t i = 0, e = sorted.size(); i != e; ++i)
+  {
+    FlatInfo *info = sorted[i];
+    int64_t cum = info->CUM_KEY[0];
+    float pct = percent(cum, totals);
+    if (pct < 1. || cum == 0)
+      break;
+
+    printf("%7.1f  ", pct);
+    if (m_isPerfTicks)
+      printf("%*s  ", maxval, thousands(static_cast<double>(cum) * m_tickPeriod, 0, 2).c_str());
+    else
+      printf("%*s  ", maxval, thousands(cum).c_str());
+
+    CpuLoadFilter::FunctionLoads &loads = loadFilter->loads(info->SYMBOL);
+    for (ci = loadFilter->nodes().begin(); ci != loadFilter->nodes().end(); ++ci)
+      if (int64_t value = loads.nodes[*ci])
+        printf("%7.1f  ", percent(value, cum));
+      else
+        printf("%7s  ", "-");
+    for (ci = loadFilter->cpus().begin(); ci != loadFilter->cpus().end(); ++ci)
+      if (int64_t value = loads.cpus[*ci])
+        printf("%7.1f  ", percent(value, cum));
+      else
+        printf("%7s  ", "-");
+    printf("%s [%d]\n", info->name(), info->rank());
+  }
+}
+
+/** One heap timeline sample: the time in seconds since the start of
+    the process and the live bytes of each call site.  */
+struct TimelineSample
+{
+  double                                time;
+  int64_t                               total;
+  std::vector<std::pair<int, int64_t> > sites;
+};
+
+/** Read the heap timeline side file @a filename written by the memory
+    profiler into @a samples.  The site names are stored in @a names
+    by site id, the process id and program name in @a program.  */
+static void
+readTimeline(const std::string &filename,
+             std::string &program,
+             std::map<int, std::string> &names,
+             std::vector<TimelineSample> &samples)
+{
+  bool isPipe = false;
+  FILE *in = openDump(filename.c_str(), isPipe);
+  char *line = 0;
+  size_t linesize = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &linesize, in)) > 0)
+  {
+    char *p = line;
+    if (line[len-1] == '\n')
+      line[--len] = 0;
+
+    if (*p == 'P' && p[1] == ' ')
+      program = p + 2;
+    else if (*p == 'S')
+    {
+      int id = strtol(p+1, &p, 10);
+      if (*p++ != ' ')
+        die("%s: malformed call site record '%s'\n", filename.c_str(), line);
+      names[id] = p;
+    }
+    else if (*p == 'T')
+    {
+      samples.resize(samples.size() + 1);
+      TimelineSample &sample = samples.back();
+      sample.time = strtod(p+1, &p);
+      if (strncmp(p, " L", 2))
+        die("%s: malformed sample record '%s'\n", filename.c_str(), line);
+      sample.total = strtoll(p+2, &p, 10);
+      while (*p == ' ')
+      {
+        int id = strtol(p+1, &p, 10);
+        if (*p != ':')
+          die("%s: malformed sample record '%s'\n", filename.c_str(), line);
+        sample.sites.push_back(std::make_pair(id, (int64_t) strtoll(p+1, &p, 10)));
+      }
+    }
+    else if (*p)
+      die("%s: not a heap timeline file\n", filename.c_str());
+  }
+
+  free(line);
+  if (isPipe)
+    pclose(in);
+  else
+    fclose(in);
+}
+
+/** Replace the mangled C++ names in @a names by demangled ones. */
+static void
+demangleNames(std::vector<std::string> &names)
+{
+  FILE *fp = 0;
+  char *cmd = 0;
+  char fname[] = "/tmp/igprof-analyse.c++filt.XXXXXXXX";
+
+  opentemp(fname, fp);
+  for (size_t i = 0, e = names.size(); i != e; ++i)
+    fprintf(fp, "%s\n", names[i].c_str());
+  fclose(fp);
+
+  openpipe(cmd, fp, "c++filt < %s", fname);
+  char *line = 0;
+  size_t linesize = 0;
+  ssize_t len;
+  for (size_t i = 0, e = names.size(); i != e && (len = getline(&line, &linesize, fp)) > 0; ++i)
+    names[i].assign(line, line[len-1] == '\n' ? len-1 : len);
+
+  free(line);
+  unlink(fname);
+  pclose(fp);
+  free(cmd);
+}
+
+/** Print the heap timelines written by the memory profiler with
+    "mem:timeline" as a stacked time series of the live memory of the
+    largest call sites, one letter per call site, and a legend.  Like
+    the massif tree, but over the run of the program rather than for a
+    single snapshot.  Call addresses in the same function are merged.
+    Every input file is shown on its own.  */
+void
+IgProfAnalyzerApplication::timeline(void)
+{
+  static const size_t   TOP_SITES = 8;
+  static const size_t   MAX_ROWS = 60;
+  static const int      WIDTH = 50;
+
+  for (size_t f = 0, fe = m_inputFiles.size(); f != fe; ++f)
+  {
+    const std::string &filename = m_inputFiles[f];
+    std::string program;
+    std::map<int, std::string> idnames;
+    std::vector<TimelineSample> samples;
+
+    verboseMessage("Reading heap timeline", filename.c_str(), ".\n");
+    readTimeline(filename, program, idnames, samples);
+    if (samples.empty())
+      die("%s: no heap timeline samples found\n", filename.c_str());
+
+    // Map the site ids to sites by name.  Site 0 collects what did
+    // not fit the profiler tables; sites without a name are left
+    // by a process which did not exit cleanly.
+    std::vector<std::string> names(1, "<other>");
+    std::map<std::string, size_t> byname;
+    std::map<int, size_t> siteof;
+    for (size_t i = 0, e = samples.size(); i != e; ++i)
+      for (size_t j = 0, je = samples[i].sites.size(); j != je; ++j)
+      {
+        int id = samples[i].sites[j].first;
+        if (siteof.count(id))
+          continue;
+
+        std::string name;
+        if (id == 0)
+          name = "<other>";
+        else if (idnames.count(id))
+          name = idnames[id];
+        else
+          name = "<unknown site " + toString(id) + ">";
+
+        if (! byname.count(name))
+        {
+          byname[name] = names.size();
+          names.push_back(name);
+        }
+        siteof[id] = byname[name];
+      }
+
+    if (m_config->doDemangle())
+      demangleNames(names);
+
+    // Live bytes per sample and site, and the peak of each site.
+    std::vector<std::vector<int64_t> > live(samples.size(),
+                                            std::vector<int64_t>(names.size(), 0));
+    std::vector<int64_t> peaks(names.size(), 0);
+    size_t peakSample = 0;
+    for (size_t i = 0, e = samples.size(); i != e; ++i)
+    {
+      for (size_t j = 0, je = samples[i].sites.size(); j != je; ++j)
+        live[i][siteof[samples[i].sites[j].first]] += samples[i].sites[j].second;
+      for (size_t s = 0, se = names.size(); s != se; ++s)
+        peaks[s] = std::max(peaks[s], live[i][s]);
+      if (samples[i].total > samples[peakSample].total)
+        peakSample = i;
+    }
+
+    // Pick the call sites with the highest peak; the rest, including
+    // the overflow site 0, are shown together as '.'.
+    std::vector<std::pair<int64_t, size_t> > ranked;
+    for (size_t s = 1, se = names.size(); s < se; ++s)
+      ranked.push_back(std::make_pair(-peaks[s], s));
+    std::sort(ranked.begin(), ranked.end());
+    if (ranked.size() > TOP_SITES)
+      ranked.resize(TOP_SITES);
+
+    // Show at most MAX_ROWS samples, the one with the most live
+    // memory out of each run of samples, so the peaks are kept.
+    std::vector<size_t> rows;
+    for (size_t r = 0, n = std::min(MAX_ROWS, samples.size()); r != n; ++r)
+    {
+      size_t first = r * samples.size() / n;
+      size_t last = (r+1) * samples.size() / n;
+      size_t best = first;
+      for (size_t i = first; i != last; ++i)
+        if (samples[i].total > samples[best].total)
+          best = i;
+      rows.push_back(best);
+    }
+
+    int64_t maxTotal = std::max(samples[peakSample].total, (int64_t) 1);
+    int maxval = max(10, thousands(maxTotal).size());
+
+    size_t space = program.find(' ');
+    if (space != std::string::npos)
+      program = program.substr(space+1) + " (pid " + program.substr(0, space) + ")";
+
+    std::cout << "Heap timeline: " << program << ", "
+              << samples.size() << " samples, peak "
+              << thousands(samples[peakSample].total) << " bytes at "
+              << std::fixed << std::setprecision(3) << samples[peakSample].time << "s\n"
+              << "\n" << std::string(70, '-') << "\n"
+              << "Live bytes by call site over time, stacked\n\n";
+    printf("%9s  %*s  %s\n", "Time", maxval, "Live", "Call sites");
+
+    for (size_t r = 0, re = rows.size(); r != re; ++r)
+    {
+      const TimelineSample &sample = samples[rows[r]];
+      const std::vector<int64_t> &values = live[rows[r]];
+      std::string bar;
+      int64_t cum = 0;
+      for (size_t t = 0, te = ranked.size(); t != te; ++t)
+      {
+        cum += values[ranked[t].second];
+        size_t end = (size_t) (cum * WIDTH / maxTotal);
+        bar.resize(std::max(bar.size(), end), 'A' + t);
+      }
+      bar.resize(std::max(bar.size(), (size_t) (sample.total * WIDTH / maxTotal)), '.');
+      printf("%9.3f  %*s  %s\n", sample.time, maxval,
+             thousands(sample.total).c_str(), bar.c_str());
+    }
+
+    std::cout << "\n" << std::string(70, '-') << "\n"
+              << "Call sites by peak live bytes\n\n";
+    printf("%4s  %*s  %s\n", "", maxval, "Peak", "Call site");
+    for (size_t t = 0, te = ranked.size(); t != te; ++t)
+      printf("%4c  %*s  %s\n", (int) ('A' + t), maxval,
+             thousands(peaks[ranked[t].second]).c_str(),
+             names[ranked[t].second].c_str());
+    printf("%4c  %*s  %s\n", '.', maxval, "", "all other call sites");
+    std::cout << "\n";
+  }
+}
+
 void
 IgProfAnalyzerApplication::topN(ProfileInfo &prof)
 {
@@ -3783,7 +4374,9 @@ IgProfAnalyzerApplication::topN(ProfileInfo &prof)
 }
 
 void
-IgProfAnalyzerApplication::analyse(ProfileInfo &prof, TreeMapBuilderFilter *baselineBuilder)
+IgProfAnalyzerApplication::analyse(ProfileInfo &prof,
+                                   TreeMapBuilderFilter *baselineBuilder,
+                                   TreeMapBuilderFilter *ratioBuilder)
 {
   prepdata(prof);
   verboseMessage("Building call tree map");
@@ -3816,6 +4409,23 @@ IgProfAnalyzerApplication::analyse(ProfileInfo &prof, TreeMapBuilderFilter *base
   for (FlatVector::const_iterator i = sorted.begin(); i != sorted.end(); i++)
     (*i)->setRank(rank++);
 
+  // Match the functions with those of the reference counter profile.
+  // This is done by name, before the names get demangled.
+  if (ratioBuilder)
+  {
+    std::map<std::string, FlatInfo *> byName;
+    FlatInfoMap *ratioMap = ratioBuilder->flatMap();
+    for (FlatInfoMap::const_iterator i = ratioMap->begin(); i != ratioMap->end(); i++)
+      byName[i->second->name()] = i->second;
+
+    for (FlatVector::const_iterator i = sorted.begin(); i != sorted.end(); i++)
+    {
+      std::map<std::string, FlatInfo *>::iterator r = byName.find((*i)->name());
+      if (r != byName.end())
+        m_ratios[(*i)->SYMBOL] = r->second;
+    }
+  }
+
   if (m_config->doDemangle() || m_config->useGdb)
   {
     verboseMessage("Resolving symbols", 0, ".\n");
@@ -3922,7 +4532,11 @@ IgProfAnalyzerApplication::generateFlatReport(ProfileInfo & /* prof */,
     FractionPrinter valfmt(maxval);
     FractionPrinter cntfmt(maxcnt);
 
-    HeaderPrinter hp(showpaths, showcalls, maxval, maxcnt, diffMode);
+    bool showratio = ! m_config->ratio().empty();
+    bool factor = m_config->ratioFactor();
+    RatioPrinter printRatio(showratio, m_ratios, factor);
+    HeaderPrinter hp(showpaths, showcalls, maxval, maxcnt, diffMode, showratio,
+                     factor ? "IPC" : "Ratio");
 
     if (diffMode)
       hp.print("Flat profile (cumulatively different entries only)", "Total");
@@ -3944,6 +4558,7 @@ IgProfAnalyzerApplication::generateFlatReport(ProfileInfo & /* prof */,
       else
         printf("%*s  ", maxval, thousands(row.CUM).c_str());
 
+      printRatio(row, row.CUM, false);
       PrintIf p(maxcnt);
       p(showcalls, thousands(row.CUM_ALL[1]));
       p(showpaths, thousands(row.SELF_ALL[2]));
@@ -3978,6 +4593,7 @@ IgProfAnalyzerApplication::generateFlatReport(ProfileInfo & /* prof */,
       else
         printf("%*s  ", maxval, thousands(row.SELF).c_str());
 
+      printRatio(row, row.SELF, true);
       PrintIf p(maxcnt);
       p(showcalls, thousands(row.SELF_ALL[1]));
       p(showpaths, thousands(row.SELF_ALL[2]));
@@ -4513,6 +5129,13 @@ IgProfAnalyzerApplication::run(void)
 
   this->parseArgs(args);
 
+  // Heap timelines are side files of their own, not profile dumps.
+  if (m_config->timeline)
+  {
+    timeline();
+    return;
+  }
+
   ProfileInfo *prof = new ProfileInfo;
   TreeMapBuilderFilter *baselineBuilder = 0;
 
@@ -4535,9 +5158,29 @@ IgProfAnalyzerApplication::run(void)
   for (size_t i = 0, e = m_inputFiles.size(); i != e; ++i)
     readDump(prof, m_inputFiles[i], stackTraceFilter);
 
+  // Read the reference counter for --ratio into a separate profile,
+  // processed with the same filters as the key counter.
+  TreeMapBuilderFilter *ratioBuilder = 0;
+  if (!m_config->ratio().empty())
+  {
+    verboseMessage("Reading reference counter", m_config->ratio().c_str(), ".\n");
+    ProfileInfo *ratioProf = new ProfileInfo;
+    std::string key = m_key;
+    m_key = m_config->ratio();
+    for (size_t i = 0, e = m_inputFiles.size(); i != e; ++i)
+      readDump(ratioProf, m_inputFiles[i], stackTraceFilter);
+    m_key = key;
+    prepdata(*ratioProf);
+    verboseMessage("Processing reference counter");
+    ratioBuilder = new TreeMapBuilderFilter(m_keyMax, ratioProf);
+    walk(ratioProf->spontaneous(), m_nodesStorage.size(), ratioBuilder);
+    verboseMessage(0, 0, " done\n");
+  }
+
   if (! m_config->isShowCallsDefined())
   {
-    if (!strncmp(m_key.c_str(), "MEM_", 4))
+    if (!strncmp(m_key.c_str(), "MEM_", 4) || !strncmp(m_key.c_str(), "MMAP_", 5)
+        || !strncmp(m_key.c_str(), "POOL_", 5))
       m_config->setShowCalls(true);
     else
       m_config->setShowCalls(false);
@@ -4551,8 +5194,10 @@ IgProfAnalyzerApplication::run(void)
     tree(*prof);
   else if (m_config->dumpAllocations)
     dumpAllocations(*prof);
+  else if (m_config->cpuLoad)
+    cpuLoad(*prof);
   else
-    analyse(*prof, baselineBuilder);
+    analyse(*prof, baselineBuilder, ratioBuilder);
 }
 
 
@@ -4749,6 +5394,13 @@ IgProfAnalyzerApplication::parseArgs(const ArgsList &args)
       m_config->setBaseline(*(++arg));
     else if (is("--diff-mode", "-D"))
       m_config->setDiffMode(true);
+    else if (is("--ratio") && left(arg))
+      m_config->setRatio(*(++arg));
+    else if (is("--ipc"))
+    {
+      m_config->setRatio("HW_CYCLES");
+      m_config->setRatioFactor(true);
+    }
     else if (is("--max-count-value", "-Mc") && left(arg))
       m_config->maxCountValue = parseOptionToInt(*(++arg), "--max-value / -Mc");
     else if (is("--min-count-value", "-mc"))
@@ -4763,6 +5415,10 @@ IgProfAnalyzerApplication::parseArgs(const ArgsList &args)
       m_config->minAverageValue = parseOptionToInt(*(++arg), "--min-average-value / -ma");
     else if (is("--dump-allocations"))
       m_config->dumpAllocations = true;
+    else if (is("--cpu-load", "-cl"))
+      m_config->cpuLoad = true;
+    else if (is("--timeline", "-tl"))
+      m_config->timeline = true;
     else if (is("--show-locality-metrics"))
     {
       m_showLocalityMetrics = true;
@@ -4798,6 +5454,10 @@ IgProfAnalyzerApplication::parseArgs(const ArgsList &args)
     m_config->setShowCalls(false);
   }
 
+  // Instructions per cycle, unless some other counter was chosen.
+  if (m_config->ratioFactor() && m_key.empty())
+    setKey("HW_INSTRUCTIONS");
+
   if (m_config->diffMode() && m_config->baseline().empty())
     die("Option --diff-mode / -D requires --baseline / -b\n%s", USAGE);
 
@@ -923,8 +923,7 @@ parse(const char *func, void *address, unsigned *patches)
     	     || insns[0] == 0xc0 || insns[0] == 0xc1
 	     || insns[0] == 0xd0 || insns[0] == 0xd1
 	     || insns[0] == 0xfe || insns[0] == 0xc6
-	     || insns[0] == 0xc7 || insns[0] == 0xf6
-	     || insns[0] == 0xf7)
+	     || insns[0] == 0xc7)
     {
       if (insns[0] == 0xc6 || insns[0] == 0xc7) //opcode groups
       {
@@ -951,22 +950,14 @@ parse(const char *func, void *address, unsigned *patches)
           n += (temp + 1), insns += (temp + 1);
       }
     }
-    // f6 and f7 group
+    // f6 and f7 group: only test has an immediate, 1 or 4 bytes
     else if (insns[0] == 0xf6 || insns[0] == 0xf7)
     {
       temp = evalModRM(insns[1], modRM);
-      if (modRM.bits.reg == 0 || modRM.bits.reg == 1) //instruction needs immediate value
-      {
-        if (temp == 6 && modRM.bits.mod == 0)
-        {
-          if (insns[0] == 0xf6)  //one byte immediate
-            *patches++ = (n+0x7)*0x100 + n+2, n += 7, insns += 7;
-          else  //4 byte immediate
-            *patches++ = (n+0xa)*0x100 + n+2, n += 10, insns += 10;
-        }
-      }
-      else if (temp == 6 && modRM.bits.mod == 0)	//rip + 32bit
-      	*patches++ = (n+0x6)*0x100 + n+2, n += 6, insns += 6;
+      if (modRM.bits.reg == 0 || modRM.bits.reg == 1)
+        temp += (insns[0] == 0xf6 ? 1 : 4);
+      if (modRM.bits.mod == 0 && modRM.bits.rm == 5)	//rip + 32bit
+      	*patches++ = (n+temp)*0x100 + n+2, n += temp, insns += temp;
       else
         n += temp, insns += temp;
     }
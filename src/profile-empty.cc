@@ -5,8 +5,12 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <cerrno>
 #include <pthread.h>
 #include <malloc.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 // -------------------------------------------------------------------
 // Traps for this profiler module
@@ -46,6 +50,17 @@ static IgProfTrace::CounterDef  s_ct_empty      = { "MEM_LIVE", IgProfTrace::TIC
 static bool                     s_init_memory   = false;
 static bool                     s_track_unused  = false;
 static bool                     s_initialized   = false;
+static const int                PAGES_SCAN      = 0; // Scan memory contents
+static const int                PAGES_PAGEMAP   = 1; // Page table via /proc/self/pagemap
+static const int                PAGES_MINCORE   = 2; // Page residency via mincore()
+static int                      s_pagemode      = PAGES_SCAN;
+static int                      s_pagemapfd     = -1;
+static bool                     s_softdirty     = false;
+static size_t                   s_pagesize      = 4096;
+static const int                PAGE_BATCH      = 512;
+static const uint64_t           PM_PRESENT      = 1ULL << 63;
+static const uint64_t           PM_SWAPPED      = 1ULL << 62;
+static const uint64_t           PM_SOFT_DIRTY   = 1ULL << 55;
 
 /** Counts zero pages and checkerboard pages in a memory range */
 static void
@@ -74,9 +89,90 @@ CountSpecialPages(IgProfTrace::Address address,
   }
 }
 
+/** Returns the number of bytes in whole pages of a memory range which
+    were never touched according to the page tables, without accessing
+    the memory itself.  With pagemap, a page is untouched if it was
+    never faulted in, or with soft-dirty tracking never written since
+    the profiler started.  With mincore(), if it is not resident.
+    Either way the state is per page, so memory reused from earlier
+    allocations counts as touched.  */
+static IgProfTrace::Value
+CountUntouchedPages(IgProfTrace::Address address, size_t size)
+{
+  IgProfTrace::Address start = (address + s_pagesize - 1) & ~(s_pagesize - 1);
+  IgProfTrace::Address end = (address + size) & ~(s_pagesize - 1);
+  IgProfTrace::Value untouched = 0;
+
+  while (start < end)
+  {
+    size_t npages = (end - start) / s_pagesize;
+    if (npages > (size_t) PAGE_BATCH)
+      npages = PAGE_BATCH;
+
+    if (s_pagemode == PAGES_PAGEMAP)
+    {
+      uint64_t entries[PAGE_BATCH];
+      ssize_t n = pread(s_pagemapfd, entries, npages * sizeof(uint64_t),
+                        start / s_pagesize * sizeof(uint64_t));
+      if (n <= 0)
+        break;
+
+      npages = n / sizeof(uint64_t);
+      for (size_t i = 0; i < npages; ++i)
+        untouched += ! (entries[i] & (PM_PRESENT | PM_SWAPPED))
+                     || (s_softdirty && ! (entries[i] & PM_SOFT_DIRTY));
+    }
+    else
+    {
+      unsigned char resident[PAGE_BATCH];
+      if (mincore((void *) start, npages * s_pagesize, resident))
+        break;
+
+      for (size_t i = 0; i < npages; ++i)
+        untouched += ! (resident[i] & 1);
+    }
+
+    start += npages * s_pagesize;
+  }
+
+  return untouched * s_pagesize;
+}
+
+#if __linux
+/** Clear the soft-dirty bits of all pages and check the kernel tracks
+    them: a page written afterwards must have the bit set again.  */
+static bool
+probeSoftDirty(void)
+{
+  bool ok = false;
+  char *probe = (char *) mmap(0, s_pagesize, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (probe == MAP_FAILED)
+    return false;
+
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd >= 0 && write(fd, "4", 1) == 1)
+  {
+    uint64_t entry = 0;
+    *(volatile char *) probe = 1;
+    ok = (pread(s_pagemapfd, &entry, sizeof(entry),
+                (uintptr_t) probe / s_pagesize * sizeof(entry)) == sizeof(entry)
+          && (entry & PM_SOFT_DIRTY));
+  }
+
+  if (fd >= 0)
+    close(fd);
+  munmap(probe, s_pagesize);
+  return ok;
+}
+#endif
+
 static IgProfTrace::Value
 derivedLeakSize(IgProfTrace::Address address, size_t size)
 {
+  if (s_pagemode != PAGES_SCAN)
+    return CountUntouchedPages(address, size);
+
   IgProfTrace::Value num_zero_pages;
   IgProfTrace::Value num_magic_pages;
 
@@ -110,8 +206,8 @@ add(void *ptr, size_t size)
   buf->lock();
   frame = buf->push(addresses+2, depth-2);
   // Defer size estimation to free()
-  ctr = buf->tick(frame, &s_ct_empty, 0, 1);
-  buf->acquire(ctr, (IgProfTrace::Address) ptr, size);
+  if ((ctr = buf->tick(frame, &s_ct_empty, 0, 1)))
+    buf->acquire(ctr, (IgProfTrace::Address) ptr, size);
   buf->traceperf(depth, tstart, tend);
   buf->unlock();
 }
@@ -176,17 +272,27 @@ initialize(void)
       options += 5;
       while (*options)
       {
-        if (! strncmp(options, ":initmem", 7))
+        if (! strncmp(options, ":initmem", 8))
         {
           s_init_memory = true;
-          options += 7;
+          options += 8;
         }
-        if (! strncmp(options, ":trackunused", 12))
+        else if (! strncmp(options, ":trackunused", 12))
         {
           s_track_unused = true;
           s_init_memory = true;
           options += 12;
         }
+        else if (! strncmp(options, ":pagemap", 8))
+        {
+          s_pagemode = PAGES_PAGEMAP;
+          options += 8;
+        }
+        else if (! strncmp(options, ":mincore", 8))
+        {
+          s_pagemode = PAGES_MINCORE;
+          options += 8;
+        }
         else
           break;
       }
@@ -204,10 +310,38 @@ initialize(void)
   if (! igprof_init("empty memory profiler", 0, false))
     return;
 
+  // The page table modes must not touch the application's memory.
+  if (s_pagemode != PAGES_SCAN)
+  {
+    s_init_memory = s_track_unused = false;
+    s_pagesize = getpagesize();
+  }
+#if __linux
+  if (s_pagemode == PAGES_PAGEMAP
+      && (s_pagemapfd = open("/proc/self/pagemap", O_RDONLY)) < 0)
+  {
+    igprof_debug("empty memory profiler: cannot read /proc/self/pagemap: %s,"
+                 " using mincore()\n", strerror(errno));
+    s_pagemode = PAGES_MINCORE;
+  }
+  else if (s_pagemode == PAGES_PAGEMAP)
+    // Clear the soft-dirty bits to tell written pages from pages
+    // only read or faulted in as zero pages.
+    s_softdirty = probeSoftDirty();
+#else
+  if (s_pagemode == PAGES_PAGEMAP)
+    s_pagemode = PAGES_MINCORE;
+#endif
+
   igprof_disable_globally();
-  igprof_debug("empty memory profiler%s%s\n",
-               s_init_memory ? ", initialize malloc'd memory with checkerboard" : "",
-               s_track_unused ? ", tracking unused pages" : "tracking zero pages");
+  if (s_pagemode != PAGES_SCAN)
+    igprof_debug("empty memory profiler, tracking untouched pages with %s\n",
+                 s_pagemode == PAGES_MINCORE ? "mincore()"
+                 : s_softdirty ? "pagemap and soft-dirty bits" : "pagemap");
+  else
+    igprof_debug("empty memory profiler%s%s\n",
+                 s_init_memory ? ", initialize malloc'd memory with checkerboard" : "",
+                 s_track_unused ? ", tracking unused pages" : "tracking zero pages");
 
   IgHook::hook(domalloc_hook_main.raw);
   IgHook::hook(docalloc_hook_main.raw);
@@ -60,8 +60,8 @@ add (int fd)
   buf->lock();
   frame = buf->push(addresses+2, depth-2);
   buf->tick(frame, &s_ct_used, 1, 1);
-  ctr = buf->tick(frame, &s_ct_live, 1, 1);
-  buf->acquire(ctr, fd, 1);
+  if ((ctr = buf->tick(frame, &s_ct_live, 1, 1)))
+    buf->acquire(ctr, fd, 1);
   buf->traceperf(depth, tstart, tend);
   buf->unlock();
 }
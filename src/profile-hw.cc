@@ -0,0 +1,367 @@
+#include "profile.h"
+#include "profile-trace.h"
+#include "hook.h"
+#include "walk-syms.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if __linux
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+// -------------------------------------------------------------------
+// Traps for this profiler module
+LIBHOOK(0, int, dofork, _main, (), (), "fork", 0, 0)
+
+// Data for this profiler module
+static IgProfTrace::CounterDef  s_ct_cycles     = { "HW_CYCLES", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_instr      = { "HW_INSTRUCTIONS", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_llc        = { "HW_LLC_MISSES", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_branch     = { "HW_BRANCH_MISSES", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_clock      = { "TASK_CLOCK_NS", IgProfTrace::TICK, -1, 0 };
+static bool                     s_initialized   = false;
+static int                      s_signal        = 0;
+static pthread_key_t            s_groupkey;
+
+/** A counter this profiler can sample. */
+struct HIDDEN HwEvent
+{
+  const char                    *option;
+  int                           type;
+  int                           config;
+  IgProfTrace::CounterDef       *def;
+  long                          period;
+};
+
+static const int                NUM_EVENTS      = 5;
+static const int                MAX_GROUP       = NUM_EVENTS;
+static const int                TASK_CLOCK      = NUM_EVENTS-1;
+
+// Every event of the group is ticked on the sampled frame.
+typedef char HwGroupCountersFit[MAX_GROUP <= IgProfTrace::MAX_COUNTERS ? 1 : -1];
+
+#if __linux
+static HwEvent                  s_events[NUM_EVENTS] = {
+  { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,      &s_ct_cycles, 1000000 },
+  { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,    &s_ct_instr,  1000000 },
+  { "llc-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,    &s_ct_llc,    10000 },
+  { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,   &s_ct_branch, 10000 },
+  { "task-clock",    PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,      &s_ct_clock,  1000000 }
+};
+#endif
+static int                      s_group[MAX_GROUP];
+static int                      s_ngroup        = 0;
+static long                     s_period        = 0;
+
+/** The counter group of a thread.  The first counter is the leader,
+    which is sampled; the others are read at each sample.  */
+struct HIDDEN HwGroup
+{
+  int                           n;
+  int                           event[MAX_GROUP];
+  int                           fd[MAX_GROUP];
+  uint64_t                      last[MAX_GROUP];
+};
+
+#if __linux
+/** Open counter @a ev for the calling thread, in the group of @a
+    leader, or as the sampled group leader if @a leader is -1.  Counts
+    in the kernel too if allowed, else in user space only.  Returns
+    the file descriptor, or -1 on failure.  */
+static int
+openEvent(HwEvent &ev, int leader)
+{
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = ev.type;
+  attr.config = ev.config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  if (leader < 0)
+  {
+    attr.sample_period = s_period;
+    attr.disabled = 1;
+  }
+
+  int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM))
+  {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+  }
+
+  return fd;
+}
+
+/** Check counter @a ev can be used in this process at all. */
+static bool
+probeEvent(HwEvent &ev)
+{
+  int fd = openEvent(ev, -1);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
+#endif
+
+/** Close the counter group of an exiting thread. */
+static void
+closeGroup(void *arg)
+{
+  HwGroup *g = (HwGroup *) arg;
+  for (int i = g->n-1; i >= 0; --i)
+    close(g->fd[i]);
+  delete g;
+}
+
+/** Open the counter group for the calling thread and have the leader's
+    overflows signalled to this thread.  */
+static void
+threadInit(void)
+{
+#if __linux
+  HwGroup *g = new HwGroup;
+  g->n = 0;
+  for (int i = 0; i < s_ngroup; ++i)
+  {
+    int fd = openEvent(s_events[s_group[i]], i ? g->fd[0] : -1);
+    if (fd < 0)
+    {
+      igprof_debug("hardware counter profiler: cannot open %s counter: %s\n",
+                   s_events[s_group[i]].option, strerror(errno));
+      if (i == 0)
+        break;
+      continue;
+    }
+    g->event[g->n] = s_group[i];
+    g->fd[g->n] = fd;
+    g->last[g->n] = 0;
+    ++g->n;
+  }
+
+  if (! g->n)
+  {
+    delete g;
+    return;
+  }
+
+  f_owner_ex owner = { F_OWNER_TID, (pid_t) syscall(SYS_gettid) };
+  if (fcntl(g->fd[0], F_SETFL, O_ASYNC) < 0
+      || fcntl(g->fd[0], F_SETSIG, s_signal) < 0
+      || fcntl(g->fd[0], F_SETOWN_EX, &owner) < 0
+      || ioctl(g->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0)
+  {
+    igprof_debug("hardware counter profiler: cannot sample %s counter: %s\n",
+                 s_events[s_group[0]].option, strerror(errno));
+    closeGroup(g);
+    return;
+  }
+
+  pthread_setspecific(s_groupkey, g);
+#endif
+}
+
+/** Counter overflow signal handler.  Read the whole counter group and
+    record for the current program location how much each counter has
+    advanced since the previous sample.  Skip the sample when this
+    profiler is not enabled; the counts then go to the next sample.  */
+static void
+hwSignalHandler(int /* nsig */, siginfo_t *info, void * /* ctx */)
+{
+#if __linux
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  if (LIKELY(igprof_disable()))
+  {
+    IgProfTrace *buf = igprof_buffer();
+    HwGroup *g = (HwGroup *) pthread_getspecific(s_groupkey);
+    uint64_t values[1 + MAX_GROUP];
+    if (LIKELY(buf && g && info && info->si_fd == g->fd[0])
+        && read(g->fd[0], values, sizeof(values)) >= ssize_t((1 + g->n) * sizeof(uint64_t)))
+    {
+      IgProfTrace::Stack *frame;
+      uint64_t tstart, tend;
+      int depth;
+
+      RDTSC(tstart);
+      depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+      RDTSC(tend);
+
+      // Drop top two stackframes (me, signal frame).
+      buf->lock();
+      frame = buf->push(addresses+2, depth-2);
+      for (int i = 0; i < g->n; ++i)
+      {
+        uint64_t delta = values[1+i] - g->last[i];
+        g->last[i] = values[1+i];
+        if (delta)
+          buf->tick(frame, s_events[g->event[i]].def, delta, 1);
+      }
+      buf->traceperf(depth, tstart, tend);
+      buf->unlock();
+    }
+  }
+  igprof_enable();
+#endif
+}
+
+// -------------------------------------------------------------------
+/** Possibly start hardware counter profiler.  */
+static void
+initialize(void)
+{
+  if (s_initialized) return;
+  s_initialized = true;
+
+  const char    *options = igprof_options();
+  bool          enable = false;
+
+  while (options && *options)
+  {
+    while (*options == ' ' || *options == ',')
+      ++options;
+
+    if (! strncmp(options, "hw", 2)
+        && (! options[2] || options[2] == ':' || options[2] == ','
+            || options[2] == ' '))
+    {
+      enable = true;
+      options += 2;
+      while (*options == ':')
+      {
+        if (! strncmp(options, ":period=", 8))
+        {
+          options += 8;
+          long period = strtol(options, const_cast<char **>(&options), 10);
+          if (period > 0)
+            s_period = period;
+          continue;
+        }
+#if __linux
+        int i;
+        for (i = 0; i < NUM_EVENTS; ++i)
+        {
+          size_t len = strlen(s_events[i].option);
+          if (! strncmp(options+1, s_events[i].option, len)
+              && (! options[len+1] || strchr(":=, ", options[len+1])))
+          {
+            options += len + 1;
+            if (*options == '=')
+            {
+              long period = strtol(options+1, const_cast<char **>(&options), 10);
+              if (period > 0)
+                s_events[i].period = period;
+            }
+            int j = 0;
+            while (j < s_ngroup && s_group[j] != i)
+              ++j;
+            if (j == s_ngroup && s_ngroup < MAX_GROUP)
+              s_group[s_ngroup++] = i;
+            break;
+          }
+        }
+        if (i == NUM_EVENTS)
+#endif
+          break;
+      }
+    }
+    else
+      options++;
+
+    while (*options && *options != ',' && *options != ' ')
+      options++;
+  }
+
+  if (! enable)
+    return;
+
+#if __linux
+  // Sample cycles and count instructions if nothing was chosen.
+  if (! s_ngroup)
+  {
+    s_group[s_ngroup++] = 0;
+    s_group[s_ngroup++] = 1;
+  }
+
+  if (! igprof_init("hardware counter profiler", &threadInit, true))
+    return;
+
+  igprof_disable_globally();
+
+  // Without a performance monitoring unit, as in many virtual machines,
+  // sample task clock instead, and keep only the counters which work.
+  if (! probeEvent(s_events[s_group[0]]))
+  {
+    igprof_debug("hardware counter profiler: cannot sample %s counter,"
+                 " sampling task clock instead\n",
+                 s_events[s_group[0]].option);
+    s_group[0] = TASK_CLOCK;
+  }
+  int n = 1;
+  for (int i = 1; i < s_ngroup; ++i)
+    if (s_group[i] != s_group[0] && probeEvent(s_events[s_group[i]]))
+      s_group[n++] = s_group[i];
+    else
+      igprof_debug("hardware counter profiler: dropping %s counter\n",
+                   s_events[s_group[i]].option);
+  s_ngroup = n;
+
+  if (! s_period)
+    s_period = s_events[s_group[0]].period;
+  s_signal = SIGRTMIN + 7;
+  igprof_debug("hardware counter profiler: sampling every %ld %s\n",
+               s_period, s_events[s_group[0]].option);
+  for (int i = 1; i < s_ngroup; ++i)
+    igprof_debug("hardware counter profiler: also counting %s\n",
+                 s_events[s_group[i]].option);
+
+  struct sigaction sa;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_sigaction = &hwSignalHandler;
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigaction(s_signal, &sa, 0);
+
+  pthread_key_create(&s_groupkey, &closeGroup);
+  threadInit();
+
+  IgHook::hook(dofork_hook_main.raw);
+  igprof_debug("hardware counter profiler enabled on signal %d\n", s_signal);
+  igprof_enable_globally();
+#else
+  igprof_debug("hardware counter profiler: not supported on this platform\n");
+#endif
+}
+
+// -------------------------------------------------------------------
+// Trap fork() to open new counters in the child.  The counters
+// inherited from the parent would keep measuring the parent's thread.
+static int
+dofork(IgHook::SafeData<igprof_dofork_t> &hook)
+{
+  igprof_disable();
+  int ret = hook.chain();
+  if (ret == 0)
+  {
+    HwGroup *g = (HwGroup *) pthread_getspecific(s_groupkey);
+    if (g)
+    {
+      pthread_setspecific(s_groupkey, 0);
+      closeGroup(g);
+    }
+    threadInit();
+  }
+
+  igprof_enable();
+  return ret;
+}
+
+// -------------------------------------------------------------------
+static bool autoboot __attribute__((used)) = (initialize(), true);
@@ -0,0 +1,463 @@
+#include "profile.h"
+#include "profile-trace.h"
+#include "hook.h"
+#include "walk-syms.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <pthread.h>
+
+// -------------------------------------------------------------------
+// Traps for this profiler module
+DUAL_HOOK(1, int, dopthread_mutex_lock, _main, _libc,
+          (pthread_mutex_t *lock), (lock),
+          "pthread_mutex_lock", 0, "libpthread.so.0")
+DUAL_HOOK(1, int, dopthread_mutex_unlock, _main, _libc,
+          (pthread_mutex_t *lock), (lock),
+          "pthread_mutex_unlock", 0, "libpthread.so.0")
+DUAL_HOOK(1, int, dopthread_rwlock_rdlock, _main, _libc,
+          (pthread_rwlock_t *lock), (lock),
+          "pthread_rwlock_rdlock", 0, "libpthread.so.0")
+DUAL_HOOK(1, int, dopthread_rwlock_wrlock, _main, _libc,
+          (pthread_rwlock_t *lock), (lock),
+          "pthread_rwlock_wrlock", 0, "libpthread.so.0")
+DUAL_HOOK(1, int, dopthread_rwlock_unlock, _main, _libc,
+          (pthread_rwlock_t *lock), (lock),
+          "pthread_rwlock_unlock", 0, "libpthread.so.0")
+DUAL_HOOK(1, int, dopthread_spin_lock, _main, _libc,
+          (pthread_spinlock_t *lock), (lock),
+          "pthread_spin_lock", 0, "libpthread.so.0")
+DUAL_HOOK(1, int, dopthread_spin_unlock, _main, _libc,
+          (pthread_spinlock_t *lock), (lock),
+          "pthread_spin_unlock", 0, "libpthread.so.0")
+DUAL_HOOK(2, int, dopthread_cond_wait, _main, _libc,
+          (pthread_cond_t *cond, pthread_mutex_t *lock), (cond, lock),
+          "pthread_cond_wait", 0, "libpthread.so.0")
+DUAL_HOOK(3, int, dopthread_cond_timedwait, _main, _libc,
+          (pthread_cond_t *cond, pthread_mutex_t *lock,
+           const struct timespec *abstime),
+          (cond, lock, abstime),
+          "pthread_cond_timedwait", 0, "libpthread.so.0")
+
+// Data for this profiler module
+static const int                MAX_HELD        = 32;
+static IgProfTrace::CounterDef  s_ct_wait       = { "LOCK_WAIT_NS", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_hold       = { "LOCK_HOLD_NS", IgProfTrace::TICK, -1, 0 };
+static bool                     s_initialized   = false;
+static bool                     s_hold          = false;
+static pthread_key_t            s_heldkey;
+
+/** A lock held by a thread, for hold time accounting. */
+struct HIDDEN LockHeld
+{
+  void                  *lock;
+  IgProfTrace::Stack    *frame;
+  uint64_t              start;
+};
+
+/** The locks currently held by a thread, innermost last. */
+struct HIDDEN LockHeldStack
+{
+  IgProfTrace           *buf;
+  int                   depth;
+  LockHeld              held[MAX_HELD];
+};
+
+/** Return current monotonic time in nanoseconds. */
+static inline uint64_t
+nowNs(void)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Stack trace of the caller of a lock hook. */
+struct HIDDEN LockTrace
+{
+  void                  *addresses[IgProfTrace::MAX_DEPTH];
+  int                   depth;
+  uint64_t              tstart;
+  uint64_t              tend;
+};
+
+/** Free a thread's held lock stack. */
+static void
+freeHeldStack(void *arg)
+{
+  delete (LockHeldStack *) arg;
+}
+
+/** Capture the stack trace of the caller of the hook.  This must be
+    done before the lock is taken: the unwinder uses locks of its own,
+    and if the hooked lock is one of them it must not be held yet. */
+static void __attribute__((noinline))
+walk(LockTrace &trace)
+{
+  RDTSC(trace.tstart);
+  trace.depth = IgHookTrace::stacktrace(trace.addresses, IgProfTrace::MAX_DEPTH);
+  RDTSC(trace.tend);
+}
+
+/** Record acquisition of @a lock by the stack in @a trace.  Ticks the
+    wait counter by @a waitns if the lock was contended, and if
+    tracking hold times, remembers the acquiring stack and time. */
+static void
+add(void *lock, LockTrace &trace, uint64_t waitns, bool contended)
+{
+  IgProfTrace *buf = igprof_buffer();
+  IgProfTrace::Stack *frame;
+
+  if (UNLIKELY(! buf))
+    return;
+
+  // Drop top two stack frames (walk, hook).
+  buf->lock();
+  frame = buf->push(trace.addresses+2, trace.depth-2);
+  if (contended)
+    buf->tick(frame, &s_ct_wait, waitns, 1);
+  buf->traceperf(trace.depth, trace.tstart, trace.tend);
+  buf->unlock();
+
+  if (s_hold)
+  {
+    LockHeldStack *held = (LockHeldStack *) pthread_getspecific(s_heldkey);
+    if (! held)
+    {
+      held = new LockHeldStack;
+      held->buf = 0;
+      held->depth = 0;
+      pthread_setspecific(s_heldkey, held);
+    }
+
+    // Frames are only valid in the buffer they were pushed to.
+    if (held->buf != buf)
+    {
+      held->buf = buf;
+      held->depth = 0;
+    }
+
+    if (held->depth < MAX_HELD)
+    {
+      LockHeld &h = held->held[held->depth++];
+      h.lock = lock;
+      h.frame = frame;
+      h.start = nowNs();
+    }
+  }
+}
+
+/** Record release of @a lock.  Ticks the hold time counter of the
+    stack which acquired the lock, if it was acquired in this thread
+    while the profiler was tracking it.  Returns true if it was. */
+static bool
+remove(void *lock)
+{
+  IgProfTrace *buf = igprof_buffer();
+  LockHeldStack *held = (LockHeldStack *) pthread_getspecific(s_heldkey);
+  if (UNLIKELY(! buf) || ! held || held->buf != buf)
+    return false;
+
+  // Locks are normally released in reverse order, search from the top.
+  for (int i = held->depth-1; i >= 0; --i)
+    if (held->held[i].lock == lock)
+    {
+      uint64_t ns = nowNs() - held->held[i].start;
+      buf->lock();
+      buf->tick(held->held[i].frame, &s_ct_hold, ns, 1);
+      buf->unlock();
+
+      memmove(&held->held[i], &held->held[i+1],
+              (held->depth-i-1) * sizeof(LockHeld));
+      --held->depth;
+      return true;
+    }
+
+  return false;
+}
+
+// -------------------------------------------------------------------
+/** Possibly start lock profiler.  */
+static void
+initialize(void)
+{
+  if (s_initialized) return;
+  s_initialized = true;
+
+  const char    *options = igprof_options();
+  bool          enable = false;
+
+  while (options && *options)
+  {
+    while (*options == ' ' || *options == ',')
+      ++options;
+
+    if (! strncmp(options, "lock", 4))
+    {
+      enable = true;
+      options += 4;
+      while (*options)
+      {
+        if (! strncmp(options, ":hold", 5))
+        {
+          s_hold = true;
+          options += 5;
+        }
+        else
+          break;
+      }
+    }
+    else
+      options++;
+
+    while (*options && *options != ',' && *options != ' ')
+      options++;
+  }
+
+  if (! enable)
+    return;
+
+  if (! igprof_init("lock profiler", 0, true))
+    return;
+
+  igprof_disable_globally();
+  if (s_hold)
+  {
+    igprof_debug("lock profiler: recording lock hold times\n");
+    pthread_key_create(&s_heldkey, &freeHeldStack);
+  }
+
+  IgHook::hook(dopthread_mutex_lock_hook_main.raw);
+  IgHook::hook(dopthread_rwlock_rdlock_hook_main.raw);
+  IgHook::hook(dopthread_rwlock_wrlock_hook_main.raw);
+  IgHook::hook(dopthread_spin_lock_hook_main.raw);
+  if (s_hold)
+  {
+    IgHook::hook(dopthread_mutex_unlock_hook_main.raw);
+    IgHook::hook(dopthread_rwlock_unlock_hook_main.raw);
+    IgHook::hook(dopthread_spin_unlock_hook_main.raw);
+    IgHook::hook(dopthread_cond_wait_hook_main.raw);
+    IgHook::hook(dopthread_cond_timedwait_hook_main.raw);
+  }
+#if __linux
+  if (dopthread_mutex_lock_hook_main.raw.chain)    IgHook::hook(dopthread_mutex_lock_hook_libc.raw);
+  if (dopthread_rwlock_rdlock_hook_main.raw.chain) IgHook::hook(dopthread_rwlock_rdlock_hook_libc.raw);
+  if (dopthread_rwlock_wrlock_hook_main.raw.chain) IgHook::hook(dopthread_rwlock_wrlock_hook_libc.raw);
+  if (dopthread_spin_lock_hook_main.raw.chain)     IgHook::hook(dopthread_spin_lock_hook_libc.raw);
+  if (s_hold)
+  {
+    if (dopthread_mutex_unlock_hook_main.raw.chain)  IgHook::hook(dopthread_mutex_unlock_hook_libc.raw);
+    if (dopthread_rwlock_unlock_hook_main.raw.chain) IgHook::hook(dopthread_rwlock_unlock_hook_libc.raw);
+    if (dopthread_spin_unlock_hook_main.raw.chain)   IgHook::hook(dopthread_spin_unlock_hook_libc.raw);
+    if (dopthread_cond_wait_hook_main.raw.chain)     IgHook::hook(dopthread_cond_wait_hook_libc.raw);
+    if (dopthread_cond_timedwait_hook_main.raw.chain) IgHook::hook(dopthread_cond_timedwait_hook_libc.raw);
+  }
+#endif
+  igprof_debug("lock profiler enabled\n");
+  igprof_enable_globally();
+}
+
+// -------------------------------------------------------------------
+// Trapped lock calls.  Try to take the lock first, and only if that
+// finds the lock busy walk the stack and time the real, blocking call.
+// Any other trylock result, such as EOWNERDEAD for a robust mutex, is
+// returned as is.  Uncontended locks cost only the trylock, unless hold
+// times are tracked.
+static int
+dopthread_mutex_lock(IgHook::SafeData<igprof_dopthread_mutex_lock_t> &hook,
+                     pthread_mutex_t *lock)
+{
+  bool enabled = igprof_disable();
+  int result;
+  if (! enabled)
+    result = hook.chain(lock);
+  else
+  {
+    LockTrace trace;
+    bool traced = s_hold;
+    if (traced)
+      walk(trace);
+
+    if ((result = pthread_mutex_trylock(lock)) == EBUSY)
+    {
+      if (! traced)
+        walk(trace);
+      uint64_t start = nowNs();
+      if ((result = hook.chain(lock)) == 0)
+        add(lock, trace, nowNs() - start, true);
+    }
+    else if (traced && result == 0)
+      add(lock, trace, 0, false);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_rwlock_rdlock(IgHook::SafeData<igprof_dopthread_rwlock_rdlock_t> &hook,
+                        pthread_rwlock_t *lock)
+{
+  bool enabled = igprof_disable();
+  int result;
+  if (! enabled)
+    result = hook.chain(lock);
+  else
+  {
+    LockTrace trace;
+    bool traced = s_hold;
+    if (traced)
+      walk(trace);
+
+    if ((result = pthread_rwlock_tryrdlock(lock)) == EBUSY)
+    {
+      if (! traced)
+        walk(trace);
+      uint64_t start = nowNs();
+      if ((result = hook.chain(lock)) == 0)
+        add(lock, trace, nowNs() - start, true);
+    }
+    else if (traced && result == 0)
+      add(lock, trace, 0, false);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_rwlock_wrlock(IgHook::SafeData<igprof_dopthread_rwlock_wrlock_t> &hook,
+                        pthread_rwlock_t *lock)
+{
+  bool enabled = igprof_disable();
+  int result;
+  if (! enabled)
+    result = hook.chain(lock);
+  else
+  {
+    LockTrace trace;
+    bool traced = s_hold;
+    if (traced)
+      walk(trace);
+
+    if ((result = pthread_rwlock_trywrlock(lock)) == EBUSY)
+    {
+      if (! traced)
+        walk(trace);
+      uint64_t start = nowNs();
+      if ((result = hook.chain(lock)) == 0)
+        add(lock, trace, nowNs() - start, true);
+    }
+    else if (traced && result == 0)
+      add(lock, trace, 0, false);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_spin_lock(IgHook::SafeData<igprof_dopthread_spin_lock_t> &hook,
+                    pthread_spinlock_t *lock)
+{
+  bool enabled = igprof_disable();
+  int result;
+  if (! enabled)
+    result = hook.chain(lock);
+  else
+  {
+    LockTrace trace;
+    bool traced = s_hold;
+    if (traced)
+      walk(trace);
+
+    if ((result = pthread_spin_trylock(lock)) == EBUSY)
+    {
+      if (! traced)
+        walk(trace);
+      uint64_t start = nowNs();
+      if ((result = hook.chain(lock)) == 0)
+        add((void *) lock, trace, nowNs() - start, true);
+    }
+    else if (traced && result == 0)
+      add((void *) lock, trace, 0, false);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+// Trapped unlock calls, only when tracking hold times.
+static int
+dopthread_mutex_unlock(IgHook::SafeData<igprof_dopthread_mutex_unlock_t> &hook,
+                       pthread_mutex_t *lock)
+{
+  if (igprof_disable())
+    remove(lock);
+  int result = hook.chain(lock);
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_rwlock_unlock(IgHook::SafeData<igprof_dopthread_rwlock_unlock_t> &hook,
+                        pthread_rwlock_t *lock)
+{
+  if (igprof_disable())
+    remove(lock);
+  int result = hook.chain(lock);
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_spin_unlock(IgHook::SafeData<igprof_dopthread_spin_unlock_t> &hook,
+                      pthread_spinlock_t *lock)
+{
+  if (igprof_disable())
+    remove((void *) lock);
+  int result = hook.chain(lock);
+  igprof_enable();
+  return result;
+}
+
+// Trapped condition variable waits, only when tracking hold times.
+// The wait releases the mutex and takes it again inside the C library,
+// out of reach of the hooks above.  End the hold before the wait and
+// start a new one by the waiting stack after it, so the time spent
+// waiting is not counted as held.
+static int
+dopthread_cond_wait(IgHook::SafeData<igprof_dopthread_cond_wait_t> &hook,
+                    pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+  bool held = false;
+  LockTrace trace;
+  if (igprof_disable() && (held = remove(lock)))
+    walk(trace);
+  int result = hook.chain(cond, lock);
+  if (held)
+    add(lock, trace, 0, false);
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_cond_timedwait(IgHook::SafeData<igprof_dopthread_cond_timedwait_t> &hook,
+                         pthread_cond_t *cond, pthread_mutex_t *lock,
+                         const struct timespec *abstime)
+{
+  bool held = false;
+  LockTrace trace;
+  if (igprof_disable() && (held = remove(lock)))
+    walk(trace);
+  int result = hook.chain(cond, lock, abstime);
+  if (held)
+    add(lock, trace, 0, false);
+  igprof_enable();
+  return result;
+}
+
+// -------------------------------------------------------------------
+static bool autoboot __attribute__((used)) = (initialize(), true);
@@ -2,20 +2,40 @@
 #include "profile-trace.h"
 #include "hook.h"
 #include "walk-syms.h"
+#include <cerrno>
+#include <cctype>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
 #include <pthread.h>
+#include <sched.h>
 #if __APPLE__
 #include <malloc/malloc.h>
 #else
 #include <malloc.h>
 #endif
 #include <unistd.h>
+#include <signal.h>
 #include <new>
+#include <time.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#ifdef __APPLE__
+# include <crt_externs.h>
+# define program_invocation_name **_NSGetArgv()
+#endif
+#if __linux
+# include <link.h>
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
 
 // -------------------------------------------------------------------
 // Traps for this profiler module
+LIBHOOK(0, int, dofork, _main, (), (), "fork", 0, 0)
 LIBHOOK(1, void *, donew, _tc,
         (size_t n), (n),
         "tc_new", 0, 0)
@@ -101,6 +121,24 @@ DUAL_HOOK(1, void, dofree, _main, _libc,
           (void *ptr), (ptr),
           "free", 0, igprof_getenv("IGPROF_MALLOC_LIB"))
 
+#if __linux
+HOOK(6, void *, dommap, _main,
+     (void *addr, size_t len, int prot, int flags, int fd, off_t off),
+     (addr, len, prot, flags, fd, off),
+     "mmap")
+HOOK(6, void *, dommap64, _main,
+     (void *addr, size_t len, int prot, int flags, int fd, off64_t off),
+     (addr, len, prot, flags, fd, off),
+     "mmap64")
+HOOK(2, int, domunmap, _main,
+     (void *addr, size_t len), (addr, len),
+     "munmap")
+HOOK(5, void *, domremap, _main,
+     (void *addr, size_t oldlen, size_t newlen, int flags, void *newaddr),
+     (addr, oldlen, newlen, flags, newaddr),
+     "mremap")
+#endif
+
 // Data for this profiler module
 static const int                OVERHEAD_NONE   = 0; // Memory use without malloc overheads
 static const int                OVERHEAD_WITH   = 1; // Memory use including malloc overheads
@@ -109,9 +147,721 @@ static const int                OVERHEAD_DELTA  = 2; // Memory use malloc overhe
 static IgProfTrace::CounterDef  s_ct_total      = { "MEM_TOTAL",    IgProfTrace::TICK, -1, 0 };
 static IgProfTrace::CounterDef  s_ct_largest    = { "MEM_MAX",      IgProfTrace::MAX, -1, 0 };
 static IgProfTrace::CounterDef  s_ct_live       = { "MEM_LIVE",     IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_faults     = { "MEM_FAULTS",   IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_lifetime   = { "MEM_LIFETIME", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_churn      = { "MEM_CHURN",    IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_heappeak   = { "MEM_HEAP_PEAK", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_sizes      = { "MEM_SIZES",    IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_remote     = { "MEM_REMOTE_FREE", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_bytesec    = { "MEM_BYTESEC",  IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_mmaptotal  = { "MMAP_TOTAL",   IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_mmaplive   = { "MMAP_LIVE",    IgProfTrace::TICK, -1, 0 };
+
+// With every option on an allocating call site collects MEM_TOTAL,
+// MEM_MAX, MEM_LIVE, MEM_FAULTS, MEM_CHURN, MEM_HEAP_PEAK,
+// MEM_REMOTE_FREE and MEM_BYTESEC.  The size and lifetime histograms
+// go in child frames.  A new per-site counter must go in a child
+// frame too, or the trace buffer must allow more counters per frame.
+static const int                MEM_SITE_COUNTERS = 8;
+typedef char MemSiteCountersFit[MEM_SITE_COUNTERS <= IgProfTrace::MAX_COUNTERS ? 1 : -1];
 static int                      s_overhead      = OVERHEAD_NONE;
 static bool                     s_initialized   = false;
+static bool                     s_enabled       = false;
 static size_t                   pagesize        = 0;
+static long                     s_faultperiod   = 0;
+static int                      s_faultsignal   = 0;
+static const int                FAULT_BATCH     = 256;
+static const int                FAULT_PAGES     = 16;
+static pthread_key_t            s_faultkey;
+static pthread_mutex_t          s_faultlock     = PTHREAD_MUTEX_INITIALIZER;
+static long                     s_samplerate    = 0;
+static const int                SAMPLE_FILTER   = 1 << 16;
+static unsigned char            s_sampled[SAMPLE_FILTER];
+static __thread int64_t         s_sampleleft    = 0;
+static __thread uint64_t        s_samplerand    = 0;
+static bool                     s_lifetimes     = false;
+static uint64_t                 s_churnlimit    = 100;
+static const int                LIFETIME_BUCKETS = 9;
+static void                     *s_lifeframes[LIFETIME_BUCKETS];
+static const char               *s_lifenames[LIFETIME_BUCKETS] = {
+  "lifetime:<1us", "lifetime:1us-10us", "lifetime:10us-100us",
+  "lifetime:100us-1ms", "lifetime:1ms-10ms", "lifetime:10ms-100ms",
+  "lifetime:100ms-1s", "lifetime:1s-10s", "lifetime:>10s"
+};
+static bool                     s_sizes         = false;
+static const size_t             SIZE_EXACT      = 256;
+static const int                SIZE_LOG_EXACT  = 8;
+static const int                SIZE_LOG_MAX    = 40;
+static void                     *s_sizeframes[SIZE_EXACT + SIZE_LOG_MAX - SIZE_LOG_EXACT + 2];
+static long                     s_peakmargin    = 0;
+static bool                     s_mmap          = false;
+static bool                     s_remotefree    = false;
+static bool                     s_bytesec       = false;
+static IgProfTrace              *s_bytesecbuf   = 0;
+static uint64_t                 s_bytesecdone   = 0;
+static uint32_t                 s_nthreads      = 0;
+static __thread uint32_t        s_threadid      = 0;
+static const IgProfTrace::Value PEAK_MIN_STEP   = 1024*1024;
+static IgProfTrace::Value       s_heaplive      = 0;
+static IgProfTrace::Value       s_heapnext      = PEAK_MIN_STEP;
+static long                     s_timelinesecs  = 0;
+static IgProfTrace::Value       s_timelinebytes = 0;
+static int                      s_timelinefd    = -1;
+static pid_t                    s_timelinepid   = 0;
+static IgProfTrace              *s_timelinebuf  = 0;
+static uint64_t                 s_timelinestart = 0;
+static uint64_t                 s_timelinenext  = 0;
+static IgProfTrace::Value       s_timelinealloc = 0;
+static unsigned                 s_timelinecalls = 0;
+static const int                TIMELINE_SITES  = 4096;
+static const int                TIMELINE_CACHE  = 16384;
+static const int                TIMELINE_CHECK  = 256;
+static void                     *s_siteaddr[TIMELINE_SITES];
+static IgProfTrace::Value       s_sitelive[TIMELINE_SITES];
+static int                      s_nsites        = 1;
+static int                      s_nsitenames    = 1;
+static void                     *s_timelinepath[IgProfTrace::MAX_DEPTH];
+static const size_t             TIMELINE_RECORD = 64 + TIMELINE_SITES * 32;
+static char                     s_timelineout[2][2 * TIMELINE_RECORD];
+static int                      s_timelinecur   = 0;
+static size_t                   s_timelinelen   = 0;
+static bool                     s_timelinereopen = false;
+static bool                     s_timelinewriting = false;
+
+/** A call address and the timeline call site it belongs to. */
+struct HIDDEN TimelineSite
+{
+  void                          *address;
+  int                           site;
+};
+
+/** Code range of a memory allocation function. */
+struct HIDDEN AllocatorRange
+{
+  char                          *start;
+  char                          *end;
+};
+
+/** A live memory mapping and the counter of the stack which made it. */
+struct HIDDEN MappedRange
+{
+  char                          *start;
+  char                          *end;
+  IgProfTrace::Counter          *counter;
+};
+
+/** A custom allocator pool annotated by the application, with its own
+    counters for the objects allocated from it.  */
+struct HIDDEN MemoryPool
+{
+  char                          name[64];
+  char                          names[3][80];
+  void                          *frame;
+  IgProfTrace::CounterDef       total;
+  IgProfTrace::CounterDef       live;
+  IgProfTrace::CounterDef       largest;
+};
+
+static const int                MAX_POOLS       = 32;
+static MemoryPool               s_pools[MAX_POOLS];
+static int                      s_npools        = 0;
+static pthread_mutex_t          s_poollock      = PTHREAD_MUTEX_INITIALIZER;
+static MappedRange              *s_mappings     = 0;
+static size_t                   s_nmappings     = 0;
+static size_t                   s_maxmappings   = 0;
+static TimelineSite             s_sitecache[TIMELINE_CACHE];
+static const int                MAX_ALLOCATORS  = 32;
+static AllocatorRange           s_allocators[MAX_ALLOCATORS];
+static int                      s_nallocators   = 0;
+static const char               *s_allocnames[] = {
+  "malloc", "calloc", "realloc", "memalign", "posix_memalign",
+  "aligned_alloc", "valloc", "pvalloc", "strdup", "strndup",
+  "_Znwm", "_Znam", "_Znwj", "_Znaj",
+  "_ZnwmRKSt9nothrow_t", "_ZnamRKSt9nothrow_t",
+  "_ZnwmSt11align_val_t", "_ZnamSt11align_val_t"
+};
+
+/** A thread's sampled page fault event and its sample ring. */
+struct HIDDEN FaultRing
+{
+  FaultRing                     *next;
+  int                           fd;
+  void                          *mem;
+};
+
+static FaultRing                *s_faultrings   = 0;
+static IgProfTrace              *s_faultbuf     = 0;
+
+/** Draw the number of bytes to allocate until the next sample from the
+    exponential distribution with mean #s_samplerate, which samples
+    every byte independently with probability 1/#s_samplerate.  */
+static int64_t
+nextSample(void)
+{
+  uint64_t &x = s_samplerand;
+  if (UNLIKELY(! x))
+  {
+    RDTSC(x);
+    x = (x ^ (uintptr_t) &x) | 1;
+  }
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  double u = ((x >> 11) + 1) * (1. / 9007199254740992.);
+  return (int64_t) (-log(u) * s_samplerate) + 1;
+}
+
+/** Check whether the calling thread samples an allocation of @a size
+    bytes.  Counts the bytes down to the next sample.  */
+static inline bool
+sampleAllocation(size_t size)
+{
+  if (UNLIKELY(! s_samplerand))
+    s_sampleleft = nextSample();
+  if (LIKELY((s_sampleleft -= size) > 0))
+    return false;
+  s_sampleleft = nextSample();
+  return true;
+}
+
+/** Return the slot of @a ptr in the filter of sampled blocks. */
+static inline unsigned char *
+sampleSlot(void *ptr)
+{
+  return &s_sampled[((uintptr_t) ptr * 0x9e3779b97f4a7c15ULL) >> 48];
+}
+
+/** Count a sampled block at @a ptr in the filter.  Slots which
+    overflow stay full.  */
+static void
+filterSampled(void *ptr)
+{
+  unsigned char *slot = sampleSlot(ptr);
+  unsigned char n = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  while (n < 255 && ! __atomic_compare_exchange_n(slot, &n, n+1, false,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/** Remove a sampled block at @a ptr from the filter. */
+static void
+unfilterSampled(void *ptr)
+{
+  unsigned char *slot = sampleSlot(ptr);
+  unsigned char n = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  while (n > 0 && n < 255 && ! __atomic_compare_exchange_n(slot, &n, n-1, false,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/** Return a small number identifying the calling thread, for telling
+    which thread allocated a block.  */
+static inline uint32_t
+currentThread(void)
+{
+  if (UNLIKELY(! s_threadid))
+    s_threadid = __atomic_add_fetch(&s_nthreads, 1, __ATOMIC_RELAXED);
+  return s_threadid;
+}
+
+/** Return the time used for allocation lifetimes, in microseconds. */
+static inline uint64_t
+lifetimeClock(void)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/** Account the lifetime of the block @a res about to be freed at
+    time @a now.  Adds the block to the lifetime bucket frame below the
+    stack which allocated it, and to the churn of that stack if it
+    lived less than #s_churnlimit microseconds.  Must be called with
+    the profile buffer @a buf locked.  */
+static void
+chargeLifetime(IgProfTrace *buf, IgProfTrace::Resource *res, uint64_t now)
+{
+  IgProfTrace::Stack *frame = res->counter->frame;
+  uint64_t life = now > res->stamp ? now - res->stamp : 0;
+  uint64_t limit = 1;
+  int bucket = 0;
+  while (bucket < LIFETIME_BUCKETS-1 && life >= limit)
+    ++bucket, limit *= 10;
+
+  if (s_lifeframes[bucket])
+    buf->tick(buf->child(frame, s_lifeframes[bucket]), &s_ct_lifetime, res->size, 1);
+  if (life < s_churnlimit)
+    buf->tick(frame, &s_ct_churn, res->size, 1);
+}
+
+/** Charge the byte-seconds of the block @a res to the stack which
+    allocated it, for the time from its allocation or the previous
+    profile dump, whichever is later, to @a now.  Counts a tick if
+    @a freed.  The counter is kept in byte-milliseconds so that the
+    rounding of each charge does not swamp the many small blocks.
+    Must be called with the profile buffer @a buf locked.  */
+static void
+chargeByteSeconds(IgProfTrace *buf, IgProfTrace::Resource *res,
+                  uint64_t now, bool freed)
+{
+  uint64_t from = res->stamp > s_bytesecdone ? res->stamp : s_bytesecdone;
+  double bytems = now > from ? (double) res->size * (now - from) / 1e3 : 0;
+  buf->tick(res->counter->frame, &s_ct_bytesec,
+            (IgProfTrace::Value) (bytems + 0.5), freed ? 1 : 0);
+}
+
+/** Charge the byte-seconds of the live blocks of @a frame and its
+    callees up to @a now.  */
+static void
+chargeLiveByteSeconds(IgProfTrace *buf, IgProfTrace::Stack *frame, uint64_t now)
+{
+  for (int i = 0; i < IgProfTrace::MAX_COUNTERS && frame->counters[i]; ++i)
+    if (frame->counters[i]->def == &s_ct_live)
+      for (IgProfTrace::Resource *res = frame->counters[i]->resources;
+           res; res = res->nextlive)
+        chargeByteSeconds(buf, res, now, false);
+
+  for (frame = frame->children; frame; frame = frame->sibling)
+    chargeLiveByteSeconds(buf, frame, now);
+}
+
+/** Charge the byte-seconds of the blocks still live before the
+    profile is dumped.  Later dumps and frees charge them from now on,
+    so the counter does not count any time twice.  */
+static void
+flushByteSeconds(void)
+{
+  IgProfTrace *buf = s_bytesecbuf;
+  if (! buf)
+    return;
+
+  igprof_disable();
+  buf->lock();
+  uint64_t now = lifetimeClock();
+  chargeLiveByteSeconds(buf, buf->stackRoot(), now);
+  s_bytesecdone = now;
+  buf->unlock();
+  igprof_enable();
+}
+
+/** Return the size histogram frame for an allocation of @a size
+    bytes: one per exact size up to #SIZE_EXACT, then one per power
+    of two, the last one for everything above 2^#SIZE_LOG_MAX.  */
+static inline void *
+sizeFrame(size_t size)
+{
+  if (size <= SIZE_EXACT)
+    return s_sizeframes[size];
+
+  int bits = 64 - __builtin_clzll((unsigned long long) size - 1);
+  if (bits > SIZE_LOG_MAX)
+    bits = SIZE_LOG_MAX + 1;
+  return s_sizeframes[SIZE_EXACT + bits - SIZE_LOG_EXACT];
+}
+
+/** Create the synthetic frames of the size histogram.  */
+static void
+initSizeFrames(void)
+{
+  char name[64];
+  for (size_t size = 0; size <= SIZE_EXACT; ++size)
+  {
+    snprintf(name, sizeof(name), "size:%lu", (unsigned long) size);
+    s_sizeframes[size] = igprof_synthetic_frame(name);
+  }
+
+  for (int bits = SIZE_LOG_EXACT+1; bits <= SIZE_LOG_MAX+1; ++bits)
+  {
+    unsigned long long low = 1ULL << (bits-1);
+    if (bits > SIZE_LOG_MAX)
+      snprintf(name, sizeof(name), "size:>%llu", low);
+    else
+      snprintf(name, sizeof(name), "size:%llu-%llu", low+1, low*2);
+    s_sizeframes[SIZE_EXACT + bits - SIZE_LOG_EXACT] = igprof_synthetic_frame(name);
+  }
+}
+
+/** Copy the live memory of @a frame and its callees to the heap peak
+    snapshot counters, replacing the previous snapshot.  */
+static void
+snapshotHeap(IgProfTrace *buf, IgProfTrace::Stack *frame)
+{
+  IgProfTrace::Counter *live = 0;
+  IgProfTrace::Counter *peak = 0;
+  for (int i = 0; i < IgProfTrace::MAX_COUNTERS && frame->counters[i]; ++i)
+    if (frame->counters[i]->def == &s_ct_live)
+      live = frame->counters[i];
+    else if (frame->counters[i]->def == &s_ct_heappeak)
+      peak = frame->counters[i];
+
+  if (! peak && live && live->value)
+    peak = buf->tick(frame, &s_ct_heappeak, 0, 0);
+
+  if (peak)
+  {
+    peak->value = peak->peak = (live ? live->value : 0);
+    peak->ticks = (live ? live->ticks : 0);
+  }
+
+  for (frame = frame->children; frame; frame = frame->sibling)
+    snapshotHeap(buf, frame);
+}
+
+/** Append a heap timeline record of @a len characters to the records
+    waiting to be written.  Must be called with the profile buffer
+    locked, and only with room for the record.  */
+static void
+timelinePut(const char *data, size_t len)
+{
+  if (s_timelinelen + len <= sizeof(s_timelineout[0]))
+  {
+    memcpy(s_timelineout[s_timelinecur] + s_timelinelen, data, len);
+    s_timelinelen += len;
+  }
+}
+
+/** Start a new heap timeline for this process, and forget the call
+    sites of the parent process after a fork.  Only queues the header,
+    the file is opened by the next timelineFlush().  Must be called
+    with the profile buffer locked, or before profiling starts.  */
+static void
+timelineStart(void)
+{
+  char header[512];
+  memset(s_sitecache, 0, sizeof(s_sitecache));
+  s_nsites = s_nsitenames = 1;
+  s_timelinelen = 0;
+  s_timelinereopen = true;
+  s_timelinewriting = false;
+  s_timelinepid = getpid();
+  s_timelinestart = lifetimeClock();
+  s_timelinenext = s_timelinestart + s_timelinesecs * 1000000ULL;
+  s_timelinealloc = 0;
+  timelinePut(header, snprintf(header, sizeof(header), "P %ld %.400s\nS0 <other>\n",
+                               (long) s_timelinepid, program_invocation_name));
+}
+
+/** Open the heap timeline file of this process.  It is named after
+    the profile output file if one was given, otherwise it goes into
+    the current directory as igprof.PROGRAM.PID.timeline.  Forked
+    children add their process id to the name.  */
+static void
+timelineOpen(bool child)
+{
+  const char *out = igprof_outname();
+  char name[1024];
+
+  // For a pipe, use the file the pipe output is redirected to.
+  if (*out == '|')
+  {
+    out = strrchr(out, '>');
+    out = out ? out+1 : "";
+    while (*out == ' ')
+      ++out;
+  }
+
+  if (*out)
+  {
+    int len = strlen(out);
+    if (len > 3 && ! strcmp(out + len - 3, ".gz"))
+      len -= 3;
+    if (child)
+      snprintf(name, sizeof(name), "%.*s.%ld.timeline",
+               len, out, (long) s_timelinepid);
+    else
+      snprintf(name, sizeof(name), "%.*s.timeline", len, out);
+  }
+  else
+  {
+    const char *progname = program_invocation_name;
+    const char *slash = strrchr(progname, '/');
+    if (slash && slash[1])
+      progname = slash+1;
+    snprintf(name, sizeof(name), "igprof.%.100s.%ld.timeline",
+             progname, (long) s_timelinepid);
+  }
+
+  if (s_timelinefd >= 0)
+    close(s_timelinefd);
+  if ((s_timelinefd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    igprof_debug("memory profiler: cannot write heap timeline %s: %s\n",
+                 name, strerror(errno));
+  else
+    igprof_debug("memory profiler: writing heap timeline to %s\n", name);
+}
+
+/** Write @a len characters at @a data to the heap timeline file. */
+static void
+timelineWrite(const char *data, size_t len)
+{
+  size_t off = 0;
+  while (s_timelinefd >= 0 && off < len)
+  {
+    ssize_t n = write(s_timelinefd, data + off, len - off);
+    if (n <= 0 && errno != EINTR)
+      break;
+    if (n > 0)
+      off += n;
+  }
+}
+
+/** Claim the heap timeline file for writing.  Returns false if another
+    thread is writing it, unless @a wait is set.  */
+static bool
+timelineClaim(bool wait)
+{
+  while (__atomic_exchange_n(&s_timelinewriting, true, __ATOMIC_ACQUIRE))
+    if (! wait)
+      return false;
+    else
+      sched_yield();
+  return true;
+}
+
+/** Write the queued heap timeline records to the file, opening it
+    first if the timeline was restarted.  The records are taken under
+    the profile buffer lock @a buf, but written without it, so that
+    allocating threads do not wait for the disk.  The caller must have
+    claimed the file with timelineClaim().  */
+static void
+timelineDrain(IgProfTrace *buf)
+{
+  while (true)
+  {
+    buf->lock();
+    const char *data = s_timelineout[s_timelinecur];
+    size_t len = s_timelinelen;
+    bool reopen = s_timelinereopen;
+    bool child = (reopen && s_timelinefd >= 0);
+    s_timelinecur ^= 1;
+    s_timelinelen = 0;
+    s_timelinereopen = false;
+    buf->unlock();
+
+    if (! len && ! reopen)
+      break;
+    if (reopen)
+      timelineOpen(child);
+    timelineWrite(data, len);
+  }
+}
+
+/** Write the queued heap timeline records, unless another thread is
+    already doing so.  Called without the profile buffer @a buf locked.  */
+static void
+timelineFlush(IgProfTrace *buf)
+{
+  if (timelineClaim(false))
+  {
+    timelineDrain(buf);
+    __atomic_store_n(&s_timelinewriting, false, __ATOMIC_RELEASE);
+  }
+}
+
+#if __linux
+/** dl_iterate_phdr() callback to add the code of the profiler itself
+    to the allocator ranges: its own allocations and hook frames are
+    not call sites of the program.  */
+static int
+findProfilerCode(struct dl_phdr_info *info, size_t, void *base)
+{
+  if ((void *) info->dlpi_addr != base)
+    return 0;
+
+  for (int i = 0; i < info->dlpi_phnum && s_nallocators < MAX_ALLOCATORS; ++i)
+    if (info->dlpi_phdr[i].p_type == PT_LOAD
+        && (info->dlpi_phdr[i].p_flags & PF_X))
+    {
+      char *start = (char *) info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+      s_allocators[s_nallocators].start = start;
+      s_allocators[s_nallocators].end = start + info->dlpi_phdr[i].p_memsz;
+      ++s_nallocators;
+    }
+  return 1;
+}
+#endif
+
+/** Remember the code of the memory allocation functions and of the
+    profiler, which are skipped when looking for the call site of an
+    allocation.  Called before any hooks are installed.  */
+static void
+findAllocators(void)
+{
+#if __linux
+  Dl_info self;
+  if (dladdr((void *) &findAllocators, &self) && self.dli_fbase)
+    dl_iterate_phdr(&findProfilerCode, self.dli_fbase);
+
+  for (size_t i = 0; i < sizeof(s_allocnames)/sizeof(s_allocnames[0])
+         && s_nallocators < MAX_ALLOCATORS; ++i)
+  {
+    void *fn = dlsym(RTLD_DEFAULT, s_allocnames[i]);
+    Dl_info info;
+    const ElfW(Sym) *sym = 0;
+    if (fn && dladdr1(fn, &info, (void **) &sym, RTLD_DL_SYMENT)
+        && sym && sym->st_size && info.dli_saddr == fn)
+    {
+      s_allocators[s_nallocators].start = (char *) fn;
+      s_allocators[s_nallocators].end = (char *) fn + sym->st_size;
+      ++s_nallocators;
+    }
+  }
+#endif
+}
+
+/** Return the timeline call site of the call at @a address, or -1 if
+    it is inside a memory allocation function.  Sites are call
+    addresses, numbered in the order first seen.  Site 0 collects the
+    sites which do not fit the tables.  */
+static int
+timelineSite(void *address)
+{
+  size_t slot = ((uintptr_t) address * 0x9e3779b97f4a7c15ULL) >> 50;
+  for (int i = 0; i < TIMELINE_CACHE; ++i, slot = (slot + 1) % TIMELINE_CACHE)
+  {
+    TimelineSite &c = s_sitecache[slot];
+    if (c.address == address)
+      return c.site;
+    if (c.address)
+      continue;
+
+    c.address = address;
+    c.site = 0;
+    for (int a = 0; a < s_nallocators; ++a)
+      if ((char *) address >= s_allocators[a].start
+          && (char *) address < s_allocators[a].end)
+        return c.site = -1;
+
+    if (s_nsites < TIMELINE_SITES)
+    {
+      s_siteaddr[s_nsites] = address;
+      c.site = s_nsites++;
+    }
+    return c.site;
+  }
+
+  return 0;
+}
+
+/** Add the live memory of @a frame and its callees to the timeline
+    call sites.  @a depth is the depth of @a frame; the call addresses
+    of its callers are in #s_timelinepath.  */
+static void
+timelineWalk(IgProfTrace::Stack *frame, int depth)
+{
+  if (depth > 0)
+    s_timelinepath[depth-1] = frame->address;
+
+  for (int i = 0; i < IgProfTrace::MAX_COUNTERS && frame->counters[i]; ++i)
+    if (frame->counters[i]->def == &s_ct_live && frame->counters[i]->value)
+    {
+      // Charge the innermost caller outside the allocation functions.
+      int site = 0;
+      for (int d = depth-1; d >= 0; --d)
+        if ((site = timelineSite(s_timelinepath[d])) >= 0)
+          break;
+      s_sitelive[site < 0 ? 0 : site] += frame->counters[i]->value;
+      break;
+    }
+
+  if (depth < IgProfTrace::MAX_DEPTH)
+    for (frame = frame->children; frame; frame = frame->sibling)
+      timelineWalk(frame, depth+1);
+}
+
+/** Queue a record of the live memory per call site to the heap timeline
+    as of time @a now, to be written with timelineFlush() once the
+    profile buffer @a buf is unlocked.  Must be called with @a buf
+    locked.  */
+static void
+timelineSample(IgProfTrace *buf, uint64_t now)
+{
+  char record[64];
+  IgProfTrace::Value total = 0;
+
+  if (UNLIKELY(getpid() != s_timelinepid))
+  {
+    timelineStart();
+    now = s_timelinestart;
+  }
+
+  for (int i = 0; i < s_nsites; ++i)
+    s_sitelive[i] = 0;
+  timelineWalk(buf->stackRoot(), 0);
+  for (int i = 0; i < s_nsites; ++i)
+    total += s_sitelive[i];
+
+  // Skip the sample if the writer is too far behind to queue it whole.
+  if (s_timelinelen + 64 + s_nsites * 32 <= sizeof(s_timelineout[0]))
+  {
+    timelinePut(record, snprintf(record, sizeof(record), "T%.3f L%ju",
+                                 (now - s_timelinestart) * 1e-6, total));
+    for (int i = 0; i < s_nsites; ++i)
+      if (s_sitelive[i])
+        timelinePut(record, snprintf(record, sizeof(record), " %d:%ju",
+                                     i, s_sitelive[i]));
+    timelinePut("\n", 1);
+  }
+
+  s_timelinealloc = 0;
+  if (s_timelinesecs)
+    s_timelinenext = now + s_timelinesecs * 1000000ULL;
+}
+
+/** Check whether a time-based heap timeline sample is due.  Reading
+    the clock costs too much to do on every call, so it is only looked
+    at every #TIMELINE_CHECK allocations and frees.  Must be called
+    with the profile buffer locked.  */
+static inline bool
+timelineDue(void)
+{
+  return s_timelinesecs
+    && ++s_timelinecalls % TIMELINE_CHECK == 0
+    && lifetimeClock() >= s_timelinenext;
+}
+
+/** Take a final heap timeline sample, write it out and name the call
+    sites.  Names are looked up only now, without holding the profile
+    buffer lock, as the dynamic linker may itself be waiting for
+    memory.  */
+static void
+timelineFinish(void)
+{
+  IgProfTrace *buf = s_timelinebuf;
+  if (! buf || s_timelinefd < 0)
+    return;
+
+  igprof_disable();
+  buf->lock();
+  timelineSample(buf, lifetimeClock());
+  int nsites = s_nsites;
+  buf->unlock();
+
+  timelineClaim(true);
+  timelineDrain(buf);
+  for (int i = s_nsitenames; i < nsites; ++i)
+  {
+    const char  *sym, *lib;
+    long        offset, liboffset;
+    char        record[1024];
+    int         len;
+
+    IgHookTrace::symbol(s_siteaddr[i], sym, lib, offset, liboffset);
+    if (sym)
+      len = snprintf(record, sizeof(record), "S%d %.900s\n", i, sym);
+    else
+    {
+      const char *base = (lib && strrchr(lib, '/') ? strrchr(lib, '/') + 1 : lib);
+      len = snprintf(record, sizeof(record), "S%d @{%.900s+%ld}\n",
+                     i, base ? base : "", liboffset);
+    }
+    timelineWrite(record, len);
+  }
+  s_nsitenames = nsites;
+  __atomic_store_n(&s_timelinewriting, false, __ATOMIC_RELEASE);
+  igprof_enable();
+}
 
 /** Record an allocation at @a ptr of @a size bytes.  Increments counters
     in the tree for the allocations as per current configuration and adds
@@ -147,19 +897,76 @@ add(void *ptr, size_t size)
       size = actual;
   }
 
+  // In sampled mode record only the sampled allocations, scaled by
+  // the inverse of their probability to be sampled.  This keeps the
+  // totals and the live memory unbiased.  A free only takes away one
+  // live block, so live blocks count once.
+  IgProfTrace::Value weight = size;
+  IgProfTrace::Value count = 1;
+  if (UNLIKELY(s_samplerate))
+  {
+    if (LIKELY(! sampleAllocation(size)))
+      return;
+
+    double p = -expm1(-(double) size / s_samplerate);
+    weight = (IgProfTrace::Value) (size / p + 0.5);
+    count = (IgProfTrace::Value) (1 / p + 0.5);
+    filterSampled(ptr);
+  }
+
   RDTSC(tstart);
   depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
   RDTSC(tend);
+  uint64_t stamp = UNLIKELY(s_lifetimes || s_bytesec) ? lifetimeClock() : 0;
+  uint32_t thread = UNLIKELY(s_remotefree) ? currentThread() : 0;
 
   // Drop top two stack frames (me, hook).
   buf->lock();
   frame = buf->push(addresses+2, depth-2);
-  buf->tick(frame, &s_ct_total, size, 1);
+  buf->tick(frame, &s_ct_total, weight, count);
   buf->tick(frame, &s_ct_largest, size, 1);
-  ctr = buf->tick(frame, &s_ct_live, size, 1);
-  buf->acquire(ctr, (IgProfTrace::Address) ptr, size);
+  ctr = buf->tick(frame, &s_ct_live, weight, 1);
+
+  // Count the allocation in its size class below the allocating stack.
+  void *sizeframe;
+  if (UNLIKELY(s_sizes) && (sizeframe = sizeFrame(size)))
+    buf->tick(buf->child(frame, sizeframe), &s_ct_sizes, weight, count);
+
+  if (UNLIKELY(s_peakmargin) && ctr)
+  {
+    // Forget a block whose free we missed, as acquire() will.
+    IgProfTrace::HResource *hres = buf->findResource((IgProfTrace::Address) ptr);
+    if (hres && hres->record)
+      s_heaplive -= hres->record->size;
+  }
+  if (LIKELY(ctr))
+    buf->acquire(ctr, (IgProfTrace::Address) ptr, weight, stamp, thread);
+
+  // Snapshot the heap on a new high-water mark.  Each snapshot walks
+  // the whole call tree, so only take one once the heap has grown by
+  // the margin since the last one.
+  if (UNLIKELY(s_peakmargin) && ctr && (s_heaplive += weight) >= s_heapnext)
+  {
+    IgProfTrace::Value step = s_heaplive / 100 * s_peakmargin;
+    s_heapnext = s_heaplive + (step > PEAK_MIN_STEP ? step : PEAK_MIN_STEP);
+    snapshotHeap(buf, buf->stackRoot());
+  }
+
+  // Sample the heap timeline every so many bytes, or check the clock
+  // every so many allocations.  Write it out after unlocking.
+  bool timeline = false;
+  if (UNLIKELY(s_timelinefd >= 0)
+      && ((s_timelinebytes && (s_timelinealloc += weight) >= s_timelinebytes)
+          || timelineDue()))
+  {
+    timelineSample(buf, lifetimeClock());
+    timeline = true;
+  }
   buf->traceperf(depth, tstart, tend);
   buf->unlock();
+
+  if (UNLIKELY(timeline))
+    timelineFlush(buf);
 }
 
 /** Remove knowledge about allocation.  If we are tracking leaks,
@@ -174,10 +981,408 @@ remove (void *ptr)
     if (UNLIKELY(! buf))
       return;
 
+    // In sampled mode most blocks were never recorded, skip them
+    // without taking the lock.
+    if (UNLIKELY(s_samplerate)
+        && LIKELY(! __atomic_load_n(sampleSlot(ptr), __ATOMIC_RELAXED)))
+      return;
+
+    uint64_t now = UNLIKELY(s_lifetimes || s_bytesec) ? lifetimeClock() : 0;
     buf->lock();
+    if (UNLIKELY(s_samplerate || s_lifetimes || s_peakmargin || s_remotefree
+                 || s_bytesec))
+    {
+      IgProfTrace::HResource *hres = buf->findResource((IgProfTrace::Address) ptr);
+      if (hres && hres->record)
+      {
+        IgProfTrace::Resource *res = hres->record;
+        if (s_samplerate)
+          unfilterSampled(ptr);
+        if (s_lifetimes)
+          chargeLifetime(buf, res, now);
+        if (s_bytesec)
+          chargeByteSeconds(buf, res, now, true);
+        if (s_remotefree && res->thread != currentThread())
+          buf->tick(res->counter->frame, &s_ct_remote, res->size, 1);
+        s_heaplive -= res->size;
+      }
+    }
     buf->release((IgProfTrace::Address) ptr);
+
+    // Check the timeline clock on frees too, so a phase which only
+    // releases memory still gets its samples.
+    bool timeline = false;
+    if (UNLIKELY(s_timelinefd >= 0) && timelineDue())
+    {
+      timelineSample(buf, lifetimeClock());
+      timeline = true;
+    }
+    buf->unlock();
+
+    if (UNLIKELY(timeline))
+      timelineFlush(buf);
+  }
+}
+
+#if __linux
+/** Return the index of the first live mapping which ends after
+    @a addr.  The mappings are sorted by address and do not overlap.  */
+static size_t
+findMapping(char *addr)
+{
+  size_t lo = 0, hi = s_nmappings;
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (s_mappings[mid].end <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/** Make room for a new mapping at index @a i of the mapping table.
+    The table is itself mapped directly, so it does not show up in
+    the profile.  Returns false if the table cannot grow.  */
+static bool
+insertMapping(size_t i)
+{
+  if (s_nmappings == s_maxmappings)
+  {
+    size_t max = s_maxmappings ? 2 * s_maxmappings : 4096;
+    void *mem = mmap(0, max * sizeof(MappedRange), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      return false;
+
+    memcpy(mem, s_mappings, s_nmappings * sizeof(MappedRange));
+    if (s_mappings)
+      munmap(s_mappings, s_maxmappings * sizeof(MappedRange));
+    s_mappings = (MappedRange *) mem;
+    s_maxmappings = max;
+  }
+
+  memmove(&s_mappings[i+1], &s_mappings[i], (s_nmappings - i) * sizeof(MappedRange));
+  ++s_nmappings;
+  return true;
+}
+
+/** Take the pages from @a start to @a end out of the live mappings
+    and subtract them from the counters of the stacks which mapped
+    them.  A mapping unmapped in the middle is split in two.  Must be
+    called with the profile buffer locked.  */
+static void
+unmapRange(char *start, char *end)
+{
+  size_t i = findMapping(start);
+  while (i < s_nmappings && s_mappings[i].start < end)
+  {
+    MappedRange m = s_mappings[i];
+    char *from = m.start > start ? m.start : start;
+    char *to = m.end < end ? m.end : end;
+    m.counter->value -= to - from;
+
+    if (from == m.start && to == m.end)
+    {
+      --m.counter->ticks;
+      --s_nmappings;
+      memmove(&s_mappings[i], &s_mappings[i+1], (s_nmappings - i) * sizeof(MappedRange));
+      continue;
+    }
+    else if (from == m.start)
+      s_mappings[i].start = to;
+    else if (to == m.end)
+      s_mappings[i].end = from;
+    else if (insertMapping(i+1))
+    {
+      s_mappings[i].end = from;
+      s_mappings[i+1].start = to;
+      s_mappings[i+1].end = m.end;
+      s_mappings[i+1].counter = m.counter;
+      ++m.counter->ticks;
+      ++i;
+    }
+    else
+    {
+      // No room to split, forget the tail.
+      m.counter->value -= m.end - to;
+      s_mappings[i].end = from;
+    }
+    ++i;
+  }
+}
+
+/** Round @a len up to whole pages, as mapped by the kernel. */
+static inline size_t
+pageRound(size_t len)
+{
+  return (len + pagesize - 1) & ~(pagesize - 1);
+}
+
+/** Record a new memory mapping of @a len bytes at @a addr.  Anything
+    previously mapped there was replaced.  */
+static void __attribute__((noinline))
+addMapping(void *addr, size_t len)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  IgProfTrace *buf = igprof_buffer();
+  if (UNLIKELY(! buf))
+    return;
+
+  char *start = (char *) addr;
+  char *end = start + pageRound(len);
+  int depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+
+  // Drop top two stack frames (me, hook).
+  buf->lock();
+  unmapRange(start, end);
+  IgProfTrace::Stack *frame = buf->push(addresses+2, depth-2);
+  buf->tick(frame, &s_ct_mmaptotal, end - start, 1);
+  IgProfTrace::Counter *ctr = buf->tick(frame, &s_ct_mmaplive, end - start, 1);
+  if (LIKELY(ctr))
+  {
+    size_t i = findMapping(start);
+    if (insertMapping(i))
+    {
+      s_mappings[i].start = start;
+      s_mappings[i].end = end;
+      s_mappings[i].counter = ctr;
+    }
+    else
+    {
+      ctr->value -= end - start;
+      --ctr->ticks;
+    }
+  }
+  buf->unlock();
+}
+
+/** Record the unmapping of @a len bytes at @a addr. */
+static void
+removeMapping(void *addr, size_t len)
+{
+  IgProfTrace *buf = igprof_buffer();
+  if (UNLIKELY(! buf))
+    return;
+
+  buf->lock();
+  unmapRange((char *) addr, (char *) addr + pageRound(len));
+  buf->unlock();
+}
+#endif
+
+#if __linux
+/** Sort @a n sampled fault addresses for IgProfTrace::findResources().
+    Called in the signal handler, so cannot use qsort(), which may
+    call malloc().  */
+static void
+sortAddresses(IgProfTrace::Address *addresses, int n)
+{
+  for (int i = 1; i < n; ++i)
+  {
+    IgProfTrace::Address a = addresses[i];
+    int j = i;
+    for ( ; j > 0 && addresses[j-1] > a; --j)
+      addresses[j] = addresses[j-1];
+    addresses[j] = a;
+  }
+}
+
+/** Charge the page faults sampled in @a ring to the stacks which
+    allocated the faulting memory.  Unless @a all, does nothing until
+    a full batch of samples is pending, as every batch costs a scan of
+    the whole live allocation table.  Faults outside live allocations
+    are ignored.  Must be called with the profile buffer @a buf locked.
+    Returns the number of samples left pending.  */
+static int
+chargeFaults(IgProfTrace *buf, FaultRing *ring, bool all)
+{
+  IgProfTrace::Address addresses[FAULT_BATCH];
+  IgProfTrace::HResource *found[FAULT_BATCH];
+  perf_event_mmap_page *meta = (perf_event_mmap_page *) ring->mem;
+  char *data = (char *) ring->mem + pagesize;
+  uint64_t size = FAULT_PAGES * pagesize;
+  uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = meta->data_tail;
+  int n = 0;
+
+  // Each sample is a header plus the address, 16 bytes.
+  if (! all && head - tail < FAULT_BATCH * 16)
+    return (head - tail) / 16;
+
+  while (tail < head && n < FAULT_BATCH)
+  {
+    // Records are 8-byte aligned, so fields never straddle the end.
+    perf_event_header *hdr = (perf_event_header *) (data + tail % size);
+    if (UNLIKELY(! hdr->size))
+    {
+      tail = head;
+      break;
+    }
+    if (hdr->type == PERF_RECORD_SAMPLE)
+      addresses[n++] = *(uint64_t *) (data + (tail + sizeof(*hdr)) % size);
+    tail += hdr->size;
+  }
+  __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+
+  sortAddresses(addresses, n);
+  buf->findResources(addresses, n, found);
+  for (int i = 0; i < n; ++i)
+    if (found[i])
+      buf->tick(found[i]->record->counter->frame, &s_ct_faults,
+                s_faultperiod, 1);
+
+  return (head - tail) / 16;
+}
+
+/** Page fault sample signal.  Charge the samples of this thread once
+    a full batch has accumulated.  Skips if this profiler is not
+    enabled, for example when the fault happened inside the profiler;
+    the samples stay in the ring for the next signal.  */
+static void
+faultSignalHandler(int /* nsig */, siginfo_t *info, void * /* ctx */)
+{
+  if (LIKELY(igprof_disable()))
+  {
+    IgProfTrace *buf = s_faultbuf;
+    FaultRing *ring = (FaultRing *) pthread_getspecific(s_faultkey);
+    if (LIKELY(buf && ring && info && info->si_fd == ring->fd))
+    {
+      buf->lock();
+      chargeFaults(buf, ring, false);
+      buf->unlock();
+    }
+  }
+  igprof_enable();
+}
+
+/** Charge the remaining page fault samples of all threads.  Called
+    before the profile is dumped.  */
+static void
+flushFaults(void)
+{
+  IgProfTrace *buf = s_faultbuf;
+  if (! buf)
+    return;
+
+  igprof_disable();
+  pthread_mutex_lock(&s_faultlock);
+  buf->lock();
+  for (FaultRing *ring = s_faultrings; ring; ring = ring->next)
+    while (chargeFaults(buf, ring, true))
+      ;
+  buf->unlock();
+  pthread_mutex_unlock(&s_faultlock);
+  igprof_enable();
+}
+
+/** Stop sampling page faults in an exiting thread.  Charges the
+    samples still pending and frees the ring.  */
+static void
+closeFaults(void *arg)
+{
+  FaultRing *ring = (FaultRing *) arg;
+  IgProfTrace *buf = s_faultbuf;
+
+  igprof_disable();
+  pthread_mutex_lock(&s_faultlock);
+  ioctl(ring->fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (buf)
+  {
+    buf->lock();
+    while (chargeFaults(buf, ring, true))
+      ;
     buf->unlock();
   }
+
+  for (FaultRing **link = &s_faultrings; *link; link = &(*link)->next)
+    if (*link == ring)
+    {
+      *link = ring->next;
+      break;
+    }
+  pthread_mutex_unlock(&s_faultlock);
+
+  munmap(ring->mem, (FAULT_PAGES + 1) * pagesize);
+  close(ring->fd);
+  delete ring;
+  igprof_enable();
+}
+
+/** Start sampling every s_faultperiod'th page fault of the calling
+    thread with the faulting data address.  Counts faults in the kernel
+    too if allowed, as when a system call writes to fresh memory.  */
+static void
+openFaults(void)
+{
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+  attr.sample_period = s_faultperiod;
+  attr.sample_type = PERF_SAMPLE_ADDR;
+  attr.disabled = 1;
+
+  int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM))
+  {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  if (fd < 0)
+  {
+    igprof_debug("memory profiler: cannot sample page faults: %s\n",
+                 strerror(errno));
+    return;
+  }
+
+  igprof_disable();
+  void *mem = mmap(0, (FAULT_PAGES + 1) * pagesize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  f_owner_ex owner = { F_OWNER_TID, (pid_t) syscall(SYS_gettid) };
+  if (mem == MAP_FAILED
+      || fcntl(fd, F_SETFL, O_ASYNC) < 0
+      || fcntl(fd, F_SETSIG, s_faultsignal) < 0
+      || fcntl(fd, F_SETOWN_EX, &owner) < 0)
+  {
+    igprof_debug("memory profiler: cannot sample page faults: %s\n",
+                 strerror(errno));
+    if (mem != MAP_FAILED)
+      munmap(mem, (FAULT_PAGES + 1) * pagesize);
+    close(fd);
+    igprof_enable();
+    return;
+  }
+
+  FaultRing *ring = new FaultRing;
+  ring->fd = fd;
+  ring->mem = mem;
+  pthread_mutex_lock(&s_faultlock);
+  ring->next = s_faultrings;
+  s_faultrings = ring;
+  pthread_mutex_unlock(&s_faultlock);
+  pthread_setspecific(s_faultkey, ring);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  igprof_enable();
+}
+#endif
+
+/** Charge the remaining page fault samples and the byte-seconds of the
+    live blocks, and finish the heap timeline before the profile is
+    dumped.  */
+static void
+flushMemory(void)
+{
+#if __linux
+  if (s_faultperiod)
+    flushFaults();
+#endif
+  flushByteSeconds();
+  timelineFinish();
 }
 
 // -------------------------------------------------------------------
@@ -218,6 +1423,93 @@ initialize(void)
           s_overhead = OVERHEAD_DELTA;
           options += 15;
         }
+        else if (! strncmp(options, ":sample=", 8))
+        {
+          options += 8;
+          long rate = strtol(options, const_cast<char **>(&options), 10);
+          if (*options == 'k' || *options == 'K')
+            rate *= 1024, ++options;
+          else if (*options == 'm' || *options == 'M')
+            rate *= 1024*1024, ++options;
+          if (rate > 0)
+            s_samplerate = rate;
+        }
+        else if (! strncmp(options, ":lifetime", 9))
+        {
+          s_lifetimes = true;
+          options += 9;
+        }
+        else if (! strncmp(options, ":bytesec", 8))
+        {
+          s_bytesec = true;
+          options += 8;
+        }
+        else if (! strncmp(options, ":remotefree", 11))
+        {
+          s_remotefree = true;
+          options += 11;
+        }
+        else if (! strncmp(options, ":mmap", 5))
+        {
+#if __linux
+          s_mmap = true;
+#endif
+          options += 5;
+        }
+        else if (! strncmp(options, ":sizes", 6))
+        {
+          s_sizes = true;
+          options += 6;
+        }
+        else if (! strncmp(options, ":churn=", 7))
+        {
+          options += 7;
+          long limit = strtol(options, const_cast<char **>(&options), 10);
+          if (limit > 0)
+            s_churnlimit = limit;
+          s_lifetimes = true;
+        }
+        else if (! strncmp(options, ":peak", 5))
+        {
+          options += 5;
+          s_peakmargin = 10;
+          if (*options == '=')
+          {
+            long margin = strtol(options+1, const_cast<char **>(&options), 10);
+            if (margin > 0)
+              s_peakmargin = margin;
+          }
+        }
+        else if (! strncmp(options, ":timeline=", 10))
+        {
+          options += 10;
+          long n = strtol(options, const_cast<char **>(&options), 10);
+          if (*options == 'k' || *options == 'K')
+            s_timelinebytes = n * 1024, ++options;
+          else if (*options == 'm' || *options == 'M')
+            s_timelinebytes = n * 1024*1024, ++options;
+          else if (*options == 'g' || *options == 'G')
+            s_timelinebytes = (IgProfTrace::Value) n * 1024*1024*1024, ++options;
+          else if (n > 0)
+          {
+            s_timelinesecs = n;
+            if (*options == 's')
+              ++options;
+          }
+        }
+        else if (! strncmp(options, ":faults", 7))
+        {
+          options += 7;
+#if __linux
+          s_faultperiod = 16;
+          if (*options == '=')
+          {
+            long period = strtol(options+1, const_cast<char **>(&options), 10);
+            if (period > 0)
+              s_faultperiod = period;
+          }
+#endif
+        }
         else
           break;
       }
@@ -232,7 +1524,15 @@ initialize(void)
   if (! enable)
     return;
 
-  if (! igprof_init("memory profiler", 0, false))
+#if __linux
+  void (*threadinit)(void) = s_faultperiod ? &openFaults : 0;
+  bool flush = s_faultperiod || s_timelinesecs || s_timelinebytes || s_bytesec;
+#else
+  void (*threadinit)(void) = 0;
+  bool flush = s_timelinesecs || s_timelinebytes || s_bytesec;
+#endif
+  if (! igprof_init("memory profiler", threadinit, false,
+                    0, flush ? &flushMemory : 0))
     return;
 
   igprof_disable_globally();
@@ -240,6 +1540,47 @@ initialize(void)
                (s_overhead == OVERHEAD_NONE ? "memory use without "
                 : s_overhead == OVERHEAD_WITH ? "memory use with " : ""),
                (s_overhead == OVERHEAD_DELTA ? " only" : ""));
+  if (s_samplerate)
+    igprof_debug("memory profiler: sampling allocations every %ld bytes"
+                 " on average\n", s_samplerate);
+  if (s_timelinesecs || s_timelinebytes)
+  {
+    findAllocators();
+    s_timelinebuf = igprof_buffer();
+    timelineStart();
+    timelineFlush(s_timelinebuf);
+    if (s_timelinesecs)
+      igprof_debug("memory profiler: sampling the heap timeline every %ld"
+                   " seconds\n", s_timelinesecs);
+    else
+      igprof_debug("memory profiler: sampling the heap timeline every %ju"
+                   " bytes allocated\n", s_timelinebytes);
+  }
+  if (s_peakmargin)
+    igprof_debug("memory profiler: capturing the heap at its peak, every"
+                 " %ld%% growth\n", s_peakmargin);
+  if (s_lifetimes)
+  {
+    for (int i = 0; i < LIFETIME_BUCKETS; ++i)
+      s_lifeframes[i] = igprof_synthetic_frame(s_lifenames[i]);
+    igprof_debug("memory profiler: recording allocation lifetimes, churn"
+                 " below %lu us\n", (unsigned long) s_churnlimit);
+  }
+  if (s_remotefree)
+    igprof_debug("memory profiler: counting blocks freed by another thread\n");
+  if (! IgProfTrace::RESOURCE_TAG_SHIFT)
+    igprof_debug("memory profiler: custom allocator pools need 64-bit"
+                 " addresses, ignoring them\n");
+  if (s_bytesec)
+  {
+    s_bytesecbuf = igprof_buffer();
+    igprof_debug("memory profiler: recording byte-seconds of allocations\n");
+  }
+  if (s_sizes)
+  {
+    initSizeFrames();
+    igprof_debug("memory profiler: recording allocation size histograms\n");
+  }
 
   IgHook::hook(domalloc_hook_main.raw);
   IgHook::hook(docalloc_hook_main.raw);
@@ -280,9 +1621,46 @@ initialize(void)
   if (dopvalloc_hook_main.raw.chain)   IgHook::hook(dopvalloc_hook_libc.raw);
   if (dovalloc_hook_main.raw.chain)    IgHook::hook(dovalloc_hook_libc.raw);
   if (dofree_hook_main.raw.chain)      IgHook::hook(dofree_hook_libc.raw);
+
+  if (s_mmap)
+  {
+    // Mappings made inside the allocation functions are their memory
+    // and skipped; the profiler is disabled there.
+    if (! pagesize)
+      pagesize = getpagesize();
+    IgHook::hook(dommap_hook_main.raw);
+    IgHook::hook(dommap64_hook_main.raw);
+    IgHook::hook(domunmap_hook_main.raw);
+    IgHook::hook(domremap_hook_main.raw);
+    igprof_debug("memory profiler: recording memory mappings\n");
+  }
+#endif
+
+#if __linux
+  if (s_faultperiod)
+  {
+    // Sample page faults with the faulting address, and charge them to
+    // the allocation the address belongs to.
+    if (! pagesize)
+      pagesize = getpagesize();
+    s_faultsignal = SIGRTMIN + 6;
+    struct sigaction sa;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = &faultSignalHandler;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigaction(s_faultsignal, &sa, 0);
+    pthread_key_create(&s_faultkey, &closeFaults);
+    s_faultbuf = igprof_buffer();
+    IgHook::hook(dofork_hook_main.raw);
+    igprof_debug("memory profiler: charging every %ld page faults to"
+                 " the allocation on signal %d\n", s_faultperiod,
+                 s_faultsignal);
+    openFaults();
+  }
 #endif
 
   igprof_debug("memory profiler enabled\n");
+  s_enabled = true;
   igprof_enable_globally();
 }
 
@@ -475,5 +1853,215 @@ dodelsize(IgHook::SafeData<igprof_dodelsize_t> &hook, void *ptr, size_t n)
   igprof_enable();
 }
 
+#if __linux
+// Traps for memory mappings.  A remapping is charged to its caller as
+// a new mapping, like realloc().
+static void *
+dommap(IgHook::SafeData<igprof_dommap_t> &hook,
+       void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+  bool enabled = igprof_disable();
+  void *result = (*hook.chain)(addr, len, prot, flags, fd, off);
+
+  if (LIKELY(enabled && result != MAP_FAILED))
+    addMapping(result, len);
+
+  igprof_enable();
+  return result;
+}
+
+static void *
+dommap64(IgHook::SafeData<igprof_dommap64_t> &hook,
+         void *addr, size_t len, int prot, int flags, int fd, off64_t off)
+{
+  bool enabled = igprof_disable();
+  void *result = (*hook.chain)(addr, len, prot, flags, fd, off);
+
+  if (LIKELY(enabled && result != MAP_FAILED))
+    addMapping(result, len);
+
+  igprof_enable();
+  return result;
+}
+
+static int
+domunmap(IgHook::SafeData<igprof_domunmap_t> &hook, void *addr, size_t len)
+{
+  bool enabled = igprof_disable();
+  int result = (*hook.chain)(addr, len);
+
+  if (LIKELY(enabled && result == 0))
+    removeMapping(addr, len);
+
+  igprof_enable();
+  return result;
+}
+
+static void *
+domremap(IgHook::SafeData<igprof_domremap_t> &hook, void *addr,
+         size_t oldlen, size_t newlen, int flags, void *newaddr)
+{
+  bool enabled = igprof_disable();
+  void *result = (*hook.chain)(addr, oldlen, newlen, flags, newaddr);
+
+  if (LIKELY(enabled && result != MAP_FAILED))
+  {
+    removeMapping(addr, oldlen);
+    addMapping(result, newlen);
+  }
+
+  igprof_enable();
+  return result;
+}
+#endif
+
+// Trap fork() to sample page faults of the child.  The inherited
+// events still measure the threads of the parent; drop them without
+// charging their samples, the parent does that.
+static int
+dofork(IgHook::SafeData<igprof_dofork_t> &hook)
+{
+  igprof_disable();
+  int ret = hook.chain();
+#if __linux
+  if (ret == 0)
+  {
+    while (FaultRing *ring = s_faultrings)
+    {
+      s_faultrings = ring->next;
+      munmap(ring->mem, (FAULT_PAGES + 1) * pagesize);
+      close(ring->fd);
+      delete ring;
+    }
+    pthread_mutex_init(&s_faultlock, 0);
+    pthread_setspecific(s_faultkey, 0);
+    openFaults();
+  }
+#endif
+  igprof_enable();
+  return ret;
+}
+
+// -------------------------------------------------------------------
+/** Return the index of the pool called @a name, creating it on first
+    use, or -1 if there are too many pools or the pool objects cannot
+    be tagged with their pool.  Pools are never removed, so they can
+    be searched without a lock.  */
+static int
+findPool(const char *name)
+{
+  if (! IgProfTrace::RESOURCE_TAG_SHIFT)
+    return -1;
+
+  int n = __atomic_load_n(&s_npools, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < n; ++i)
+    if (! strncmp(s_pools[i].name, name, sizeof(s_pools[i].name)-1))
+      return i;
+
+  pthread_mutex_lock(&s_poollock);
+  int i = 0;
+  for (n = s_npools; i < n; ++i)
+    if (! strncmp(s_pools[i].name, name, sizeof(s_pools[i].name)-1))
+      break;
+
+  if (i == n && n < MAX_POOLS)
+  {
+    // Counter names are put in the dump as is, keep them to safe characters.
+    MemoryPool &p = s_pools[n];
+    char safe[sizeof(p.name)];
+    char frame[sizeof(p.name)+8];
+    strncpy(p.name, name, sizeof(p.name)-1);
+    for (size_t c = 0; c < sizeof(safe); ++c)
+      safe[c] = (! p.name[c] || isalnum((unsigned char) p.name[c])) ? p.name[c] : '_';
+    snprintf(p.names[0], sizeof(p.names[0]), "POOL_%s_TOTAL", safe);
+    snprintf(p.names[1], sizeof(p.names[1]), "POOL_%s_LIVE", safe);
+    snprintf(p.names[2], sizeof(p.names[2]), "POOL_%s_MAX", safe);
+    snprintf(frame, sizeof(frame), "pool:%s", p.name);
+    p.frame = igprof_synthetic_frame(frame);
+    IgProfTrace::CounterDef total = { p.names[0], IgProfTrace::TICK, -1, 0 };
+    IgProfTrace::CounterDef live = { p.names[1], IgProfTrace::TICK, -1, 0 };
+    IgProfTrace::CounterDef largest = { p.names[2], IgProfTrace::MAX, -1, 0 };
+    p.total = total;
+    p.live = live;
+    p.largest = largest;
+    __atomic_store_n(&s_npools, n+1, __ATOMIC_RELEASE);
+    igprof_debug("memory profiler: recording pool '%s'\n", p.name);
+  }
+  else if (i == n)
+    i = -1;
+  pthread_mutex_unlock(&s_poollock);
+  return i;
+}
+
+/** Return the resource key of an object at @a ptr in pool @a pool.
+    Objects may share the address of the block they were carved from,
+    so the pool is kept in the high bits.  */
+static inline IgProfTrace::Address
+poolResource(int pool, void *ptr)
+{
+  return (IgProfTrace::Address) ptr
+    | ((IgProfTrace::Address) (pool + 1) << IgProfTrace::RESOURCE_TAG_SHIFT);
+}
+
+/** Record the allocation of an object of @a size bytes at @a ptr from
+    the custom allocator pool called @a pool.  The object is charged to
+    the stack which called this function in the counters POOL_NAME_TOTAL,
+    POOL_NAME_LIVE and POOL_NAME_MAX, and released with igprof_free().
+    Allocators should call this for objects they carve out of memory
+    they got from malloc() or mmap().  Does nothing unless the memory
+    profiler is on.  */
+extern "C" VISIBLE void __attribute__((noinline))
+igprof_alloc(const char *pool, void *ptr, size_t size)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  if (! s_enabled || ! pool || ! ptr)
+    return;
+
+  if (LIKELY(igprof_disable()))
+  {
+    IgProfTrace *buf = igprof_buffer();
+    int index = findPool(pool);
+    if (LIKELY(buf && index >= 0))
+    {
+      MemoryPool &p = s_pools[index];
+      int depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+
+      // Drop top stack frame (me).  Charge the pool below the stack
+      // in its own frame so a call site serving many pools does not
+      // run out of counters.
+      buf->lock();
+      IgProfTrace::Stack *frame = buf->push(addresses+1, depth-1);
+      if (LIKELY(p.frame))
+        frame = buf->child(frame, p.frame);
+      buf->tick(frame, &p.total, size, 1);
+      buf->tick(frame, &p.largest, size, 1);
+      if (IgProfTrace::Counter *ctr = buf->tick(frame, &p.live, size, 1))
+        buf->acquire(ctr, poolResource(index, ptr), size);
+      buf->unlock();
+    }
+  }
+  igprof_enable();
+}
+
+/** Record that the object at @a ptr was returned to the custom
+    allocator pool called @a pool.  */
+extern "C" VISIBLE void
+igprof_free(const char *pool, void *ptr)
+{
+  if (! s_enabled || ! pool || ! ptr)
+    return;
+
+  igprof_disable();
+  IgProfTrace *buf = igprof_buffer();
+  int index = findPool(pool);
+  if (LIKELY(buf && index >= 0))
+  {
+    buf->lock();
+    buf->release(poolResource(index, ptr));
+    buf->unlock();
+  }
+  igprof_enable();
+}
+
 // -------------------------------------------------------------------
 static bool autoboot __attribute__((used)) = (initialize(), true);
@@ -0,0 +1,344 @@
+#include "profile.h"
+#include "profile-trace.h"
+#include "hook.h"
+#include "walk-syms.h"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/select.h>
+#if __linux
+# include <sys/epoll.h>
+#endif
+
+// -------------------------------------------------------------------
+// Traps for this profiler module
+DUAL_HOOK(1, int, dopthread_mutex_lock, _main, _libc,
+          (pthread_mutex_t *mutex), (mutex),
+          "pthread_mutex_lock", 0, "libpthread.so.0")
+DUAL_HOOK(2, int, dopthread_cond_wait, _main, _libc,
+          (pthread_cond_t *cond, pthread_mutex_t *mutex), (cond, mutex),
+          "pthread_cond_wait", 0, "libpthread.so.0")
+DUAL_HOOK(3, int, dopthread_cond_timedwait, _main, _libc,
+          (pthread_cond_t *cond, pthread_mutex_t *mutex,
+           const struct timespec *abstime),
+          (cond, mutex, abstime),
+          "pthread_cond_timedwait", 0, "libpthread.so.0")
+DUAL_HOOK(1, int, dosem_wait, _main, _libc,
+          (sem_t *sem), (sem),
+          "sem_wait", 0, "libpthread.so.0")
+DUAL_HOOK(3, int, dopoll, _main, _libc,
+          (struct pollfd *fds, nfds_t nfds, int timeout),
+          (fds, nfds, timeout),
+          "poll", 0, "libc.so.6")
+DUAL_HOOK(5, int, doselect, _main, _libc,
+          (int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
+           struct timeval *timeout),
+          (nfds, rfds, wfds, efds, timeout),
+          "select", 0, "libc.so.6")
+DUAL_HOOK(3, ssize_t, doread, _main, _libc,
+          (int fd, void *data, size_t n), (fd, data, n),
+          "read", 0, "libc.so.6")
+DUAL_HOOK(2, int, donanosleep, _main, _libc,
+          (const struct timespec *req, struct timespec *rem), (req, rem),
+          "nanosleep", 0, "libc.so.6")
+#if __linux
+DUAL_HOOK(4, int, doepoll_wait, _main, _libc,
+          (int epfd, struct epoll_event *events, int maxevents, int timeout),
+          (epfd, events, maxevents, timeout),
+          "epoll_wait", 0, "libc.so.6")
+#endif
+
+// Data for this profiler module
+static IgProfTrace::CounterDef  s_ct_offcpu     = { "OFFCPU_NS", IgProfTrace::TICK, -1, 0 };
+static bool                     s_initialized   = false;
+static uint64_t                 s_threshold     = 100000;
+
+/** Return current monotonic time in nanoseconds. */
+static inline uint64_t
+nowNs(void)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Return the nanoseconds elapsed since @a start if it is at least the
+    minimum blocked time worth recording, otherwise zero. */
+static inline uint64_t
+blockedNs(uint64_t start)
+{
+  uint64_t dt = nowNs() - start;
+  return dt >= s_threshold ? dt : 0;
+}
+
+/** Record @a ns nanoseconds blocked in the caller of the hook. */
+static void __attribute__((noinline))
+add(uint64_t ns)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  IgProfTrace *buf = igprof_buffer();
+  IgProfTrace::Stack *frame;
+  uint64_t tstart, tend;
+  int depth;
+
+  if (UNLIKELY(! buf))
+    return;
+
+  RDTSC(tstart);
+  depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+  RDTSC(tend);
+
+  // Drop top two stack frames (me, hook).
+  buf->lock();
+  frame = buf->push(addresses+2, depth-2);
+  buf->tick(frame, &s_ct_offcpu, ns, 1);
+  buf->traceperf(depth, tstart, tend);
+  buf->unlock();
+}
+
+// -------------------------------------------------------------------
+/** Possibly start off-cpu profiler.  */
+static void
+initialize(void)
+{
+  if (s_initialized) return;
+  s_initialized = true;
+
+  const char    *options = igprof_options();
+  bool          enable = false;
+
+  while (options && *options)
+  {
+    while (*options == ' ' || *options == ',')
+      ++options;
+
+    if (! strncmp(options, "offcpu", 6))
+    {
+      enable = true;
+      options += 6;
+      while (*options)
+      {
+        if (! strncmp(options, ":min=", 5))
+        {
+          options += 5;
+          s_threshold = strtoul(options, const_cast<char **>(&options), 10) * 1000;
+        }
+        else
+          break;
+      }
+    }
+    else
+      options++;
+
+    while (*options && *options != ',' && *options != ' ')
+      options++;
+  }
+
+  if (! enable)
+    return;
+
+  if (! igprof_init("off-cpu profiler", 0, true))
+    return;
+
+  igprof_disable_globally();
+  igprof_debug("off-cpu profiler: recording waits of at least %lu us\n",
+               (unsigned long) s_threshold / 1000);
+  IgHook::hook(dopthread_mutex_lock_hook_main.raw);
+  IgHook::hook(dopthread_cond_wait_hook_main.raw);
+  IgHook::hook(dopthread_cond_timedwait_hook_main.raw);
+  IgHook::hook(dosem_wait_hook_main.raw);
+  IgHook::hook(dopoll_hook_main.raw);
+  IgHook::hook(doselect_hook_main.raw);
+  IgHook::hook(doread_hook_main.raw);
+  IgHook::hook(donanosleep_hook_main.raw);
+#if __linux
+  IgHook::hook(doepoll_wait_hook_main.raw);
+  if (dopthread_mutex_lock_hook_main.raw.chain)     IgHook::hook(dopthread_mutex_lock_hook_libc.raw);
+  if (dopthread_cond_wait_hook_main.raw.chain)      IgHook::hook(dopthread_cond_wait_hook_libc.raw);
+  if (dopthread_cond_timedwait_hook_main.raw.chain) IgHook::hook(dopthread_cond_timedwait_hook_libc.raw);
+  if (dosem_wait_hook_main.raw.chain)               IgHook::hook(dosem_wait_hook_libc.raw);
+  if (dopoll_hook_main.raw.chain)                   IgHook::hook(dopoll_hook_libc.raw);
+  if (doselect_hook_main.raw.chain)                 IgHook::hook(doselect_hook_libc.raw);
+  if (doread_hook_main.raw.chain)                   IgHook::hook(doread_hook_libc.raw);
+  if (donanosleep_hook_main.raw.chain)              IgHook::hook(donanosleep_hook_libc.raw);
+  if (doepoll_wait_hook_main.raw.chain)             IgHook::hook(doepoll_wait_hook_libc.raw);
+#endif
+  igprof_debug("off-cpu profiler enabled\n");
+  igprof_enable_globally();
+}
+
+// -------------------------------------------------------------------
+// Trapped blocking calls.  Measure the time spent in each call, and
+// record it if it blocked long enough.  Uncontended mutexes are taken
+// with a trylock without consulting the clock at all; only a busy one
+// goes on to the timed call, other trylock results are returned as is.
+static int
+dopthread_mutex_lock(IgHook::SafeData<igprof_dopthread_mutex_lock_t> &hook,
+                     pthread_mutex_t *mutex)
+{
+  bool enabled = igprof_disable();
+  int result;
+  if (! enabled)
+    result = hook.chain(mutex);
+  else if ((result = pthread_mutex_trylock(mutex)) == EBUSY)
+  {
+    uint64_t start = nowNs();
+    result = hook.chain(mutex);
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_cond_wait(IgHook::SafeData<igprof_dopthread_cond_wait_t> &hook,
+                    pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  int result = hook.chain(cond, mutex);
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dopthread_cond_timedwait(IgHook::SafeData<igprof_dopthread_cond_timedwait_t> &hook,
+                         pthread_cond_t *cond, pthread_mutex_t *mutex,
+                         const struct timespec *abstime)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  int result = hook.chain(cond, mutex, abstime);
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dosem_wait(IgHook::SafeData<igprof_dosem_wait_t> &hook, sem_t *sem)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  int result = hook.chain(sem);
+  int err = errno;
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static int
+dopoll(IgHook::SafeData<igprof_dopoll_t> &hook,
+       struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  int result = hook.chain(fds, nfds, timeout);
+  int err = errno;
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static int
+doselect(IgHook::SafeData<igprof_doselect_t> &hook,
+         int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
+         struct timeval *timeout)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  int result = hook.chain(nfds, rfds, wfds, efds, timeout);
+  int err = errno;
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+doread(IgHook::SafeData<igprof_doread_t> &hook, int fd, void *data, size_t n)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  ssize_t result = hook.chain(fd, data, n);
+  int err = errno;
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static int
+donanosleep(IgHook::SafeData<igprof_donanosleep_t> &hook,
+            const struct timespec *req, struct timespec *rem)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  int result = hook.chain(req, rem);
+  int err = errno;
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+#if __linux
+static int
+doepoll_wait(IgHook::SafeData<igprof_doepoll_wait_t> &hook,
+             int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+  bool enabled = igprof_disable();
+  uint64_t start = enabled ? nowNs() : 0;
+  int result = hook.chain(epfd, events, maxevents, timeout);
+  int err = errno;
+
+  if (enabled)
+    if (uint64_t ns = blockedNs(start))
+      add(ns);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+#endif
+
+// -------------------------------------------------------------------
+static bool autoboot __attribute__((used)) = (initialize(), true);
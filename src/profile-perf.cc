@@ -2,11 +2,22 @@
 #include "profile-trace.h"
 #include "hook.h"
 #include "walk-syms.h"
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <signal.h>
+#include <unistd.h>
 #include <sys/time.h>
+#if __linux
+# include <time.h>
+# include <sched.h>
+# include <dirent.h>
+# include <sys/syscall.h>
+# ifndef sigev_notify_thread_id
+#  define sigev_notify_thread_id _sigev_un._tid
+# endif
+#endif
 
 #ifdef __APPLE__
 typedef sig_t sighandler_t;
@@ -35,22 +46,452 @@ LIBHOOK(1, int, doclose, _main, (int fd), (fd), "close", 0, 0)
 
 // Data for this profiler module
 static IgProfTrace::CounterDef  s_ct_ticks      = { "PERF_TICKS", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_wall       = { "WALL_TICKS", IgProfTrace::TICK, -1, 0 };
 static bool                     s_initialized   = false;
 static bool                     s_keep          = false;
+static bool                     s_wall          = false;
 static int                      s_signal        = SIGPROF;
 static int                      s_itimer        = ITIMER_PROF;
+static int                      s_wallsignal    = SIGALRM;
+static long                     s_period        = 5000;
+static long                     s_regionperiod  = 0;
+static long                     s_basescale     = 1;
+static bool                     s_threadtimer   = false;
+static long                     s_budget        = 0;
+static const int                BUDGET_SAMPLES  = 32;
+static const long               MAX_SCALE       = 1000;
+static long                     s_scale         = 1;
+static __thread long            s_threadscale   = 1;
+static pthread_key_t            s_budgetkey;
+static const int                MAX_REGIONS     = 16;
+static bool                     s_enabled       = false;
+static pthread_key_t            s_regionkey;
+static const int                RING_HEADER     = 4;
+static const size_t             RING_MIN        = 1 << 10;
+static const size_t             RING_MAX        = 1 << 20;
+static const int                RING_TYPICAL    = 64;
+static const long               RING_LAG_US     = 50000;
+static size_t                   s_ringsize      = 0;
+static bool                     s_async         = false;
+static pthread_key_t            s_ringkey;
+static pthread_mutex_t          s_ringlock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t          s_drainlock     = PTHREAD_MUTEX_INITIALIZER;
+static IgProfTrace              *s_collectorbuf = 0;
+static int                      s_sampler       = 0;
+static const int                MAX_CPUS        = 1024;
+static bool                     s_cpu           = false;
+static void                     *s_cpuframes[MAX_CPUS];
+static void                     *s_nodeframes[MAX_CPUS];
+static const int                MAX_SYSCALLS    = 512;
+static bool                     s_syscall       = false;
+static void                     *s_syscallframes[MAX_SYSCALLS];
+
+/** Per-thread state of the overhead budget controller. */
+struct HIDDEN PerfBudget
+{
+  uint64_t      start;          //< Time at start of window, in ns.
+  uint64_t      cost;           //< Time spent sampling in window, in ns.
+  int           nsamples;       //< Samples taken in window.
+};
+
+/** A code region marked with igprof_region_enter(). */
+struct HIDDEN PerfRegion
+{
+  void          *frame;         //< Synthetic frame for the region.
+  int           depth;          //< Stack depth of the region entry.
+};
+
+/** The marked regions a thread is in, innermost last. */
+struct HIDDEN PerfRegionStack
+{
+  PerfRegion    region[MAX_REGIONS];
+  int           depth;          //< Number of regions in #region.
+  int           overflow;       //< Regions nested too deep to track.
+};
+
+/** Single producer, single consumer ring of raw samples of one
+    thread.  The signal handler appends records of #RING_HEADER words
+    (stack depth, cpu and wall clock weights, stack walk cycles) and
+    the stack addresses; the collector removes them.  The indices run
+    freely and are reduced modulo the power-of-two #s_ringsize.  */
+struct HIDDEN PerfRing
+{
+  PerfRing      *next;          //< Next ring of all threads.
+  uint64_t      head;           //< Producer index, set by the thread.
+  uint64_t      tail;           //< Consumer index, set by the collector.
+  uint64_t      dropped;        //< Samples dropped on a full ring.
+  bool          dead;           //< Set when the thread has exited.
+  void          **data;         //< The ring of #s_ringsize words.
+};
+
+static PerfRing                 *s_rings        = 0;
+
+#if __linux
+/** A thread signalled by the sampler thread.  The cpu and wall clock
+    times are those up to which samples have been sent already. */
+struct HIDDEN PerfSampled
+{
+  PerfSampled   *next;          //< Next sampled thread.
+  pthread_t     thread;         //< The thread.
+  clockid_t     clock;          //< Cpu time clock of the thread.
+  uint64_t      cpu;            //< Cpu time accounted for, ns.
+  uint64_t      wall;           //< Wall clock time accounted for, ns.
+};
+
+static pthread_key_t            s_sampledkey;
+static pthread_mutex_t          s_samplelock    = PTHREAD_MUTEX_INITIALIZER;
+static PerfSampled              *s_sampled      = 0;
+static PerfSampled              *s_cursor       = 0;
+static int                      s_nsampled      = 0;
+#endif
+
+#if __linux
+static pthread_key_t            s_timerkey;
+
+/** Per-thread profiling timers. */
+struct PerfThreadTimers
+{
+  timer_t       cpu;
+  timer_t       wall;
+  bool          haswall;
+};
+#endif
 
 /** Convert timeval to seconds. */
 static inline double tv2sec(const timeval &tv)
 { return tv.tv_sec + tv.tv_usec * 1e-6; }
 
+static int getTimer(itimerval *value, bool wall = false);
+static void setTimer(const itimerval *value, itimerval *ovalue, bool wall = false);
+
+/** Return the marked regions the calling thread is in, or null. */
+static inline PerfRegionStack *
+threadRegions(void)
+{
+  return (PerfRegionStack *) pthread_getspecific(s_regionkey);
+}
+
+/** Return the smallest sampling interval allowed in the calling
+    thread, as a multiple of the sampling period: the period itself
+    in a marked region, otherwise the base rate interval.  Zero if
+    the thread should not be sampled at all.  */
+static inline long
+minScale(void)
+{
+  PerfRegionStack *regions = threadRegions();
+  return (regions && regions->depth > 0) ? 1 : s_basescale;
+}
+
+/** Set the profiling timers of the calling thread to fire every
+    @a scale sampling periods, or stop them if @a scale is zero.  Does
+    nothing with the sampler thread, which has a fixed rate.  The
+    scale is remembered for timerScale(), per thread if the timers
+    are, so the signal handler need not ask the kernel.  */
+static void
+setScale(long scale)
+{
+  if (s_sampler)
+    return;
+
+  long period = s_period * scale;
+  itimerval interval = { { period / 1000000, period % 1000000 },
+                         { period / 1000000, period % 1000000 } };
+  setTimer(&interval, 0);
+  if (s_wall)
+    setTimer(&interval, 0, true);
+
+  if (scale > 0)
+  {
+    s_threadscale = scale;
+    __atomic_store_n(&s_scale, scale, __ATOMIC_RELAXED);
+  }
+}
+
+/** Return the current interval of the profiling timers of the calling
+    thread as a multiple of the configured sampling period, as last set
+    with setScale().  Both timers always have the same interval.  */
+static inline long
+timerScale(void)
+{
+  return s_threadtimer ? s_threadscale : __atomic_load_n(&s_scale, __ATOMIC_RELAXED);
+}
+
+/** Return the time for the overhead budget, in nanoseconds.  Unlike
+    the cycle counter this is available everywhere, and it is safe to
+    call from a signal handler.  */
+static inline uint64_t
+budgetClock(void)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Account the time spent in the signal handler since @a tenter
+    against the overhead budget, and every #BUDGET_SAMPLES samples
+    rescale the sampling interval, currently @a scale times the
+    configured period, so the profiler stays within the budget.
+
+    This runs in the signal handler so sticks to integer math.  The
+    overhead is computed in basis points like the budget.  The new
+    interval is proportional to the measured overhead, but changes by
+    at most a factor of two at a time and never drops below the
+    configured period.  */
+static void
+adjustBudget(uint64_t tenter, long scale)
+{
+  PerfBudget *budget = (PerfBudget *) pthread_getspecific(s_budgetkey);
+  uint64_t now;
+  if (! budget)
+    return;
+
+  now = budgetClock();
+  if (! budget->start)
+  {
+    budget->start = now;
+    return;
+  }
+
+  budget->cost += now - tenter;
+  if (++budget->nsamples < BUDGET_SAMPLES)
+    return;
+
+  uint64_t elapsed = now - budget->start;
+  long used = elapsed ? long(budget->cost * 10000 / elapsed) : 0;
+  long target = (scale * used + s_budget - 1) / s_budget;
+  if (target > scale * 2)
+    target = scale * 2;
+  if (target < scale / 2)
+    target = scale / 2;
+  if (target > MAX_SCALE)
+    target = MAX_SCALE;
+  long floor = minScale();
+  if (target < floor)
+    target = floor;
+
+  if (floor && target != scale)
+    setScale(target);
+
+  budget->start = now;
+  budget->cost = 0;
+  budget->nsamples = 0;
+}
+
+/** Insert the synthetic frames of the marked regions the calling
+    thread is in into the stack trace of @a depth frames in @a
+    addresses, just below the function which entered each region.
+    Returns the new stack depth.  */
+static int
+insertRegions(void **addresses, int depth, int maxdepth)
+{
+  PerfRegionStack *regions = threadRegions();
+  if (! regions)
+    return depth;
+
+  for (int i = regions->depth-1; i >= 0 && depth < maxdepth; --i)
+  {
+    // The stack is leaf first, count the entry depth from the root.
+    int pos = depth - regions->region[i].depth;
+    if (pos < 0)
+      pos = 0;
+    memmove(&addresses[pos+1], &addresses[pos],
+            (depth - pos) * sizeof(void *));
+    addresses[pos] = regions->region[i].frame;
+    ++depth;
+  }
+
+  return depth;
+}
+
+/** Append the synthetic frames of the cpu the calling thread runs on,
+    and of its NUMA node, to the root end of the stack trace of @a
+    depth frames in @a addresses, replacing the outermost frames if
+    the trace is full.  Returns the new stack depth.  */
+static int
+insertCpu(void **addresses, int depth, int maxdepth)
+{
+#if __linux
+  // Served from the rseq area or the vdso, no system call.
+  int cpu = sched_getcpu();
+  if (cpu < 0 || cpu >= MAX_CPUS || ! s_cpuframes[cpu])
+    return depth;
+
+  if (depth > maxdepth - 2)
+    depth = maxdepth - 2;
+  addresses[depth++] = s_cpuframes[cpu];
+  if (s_nodeframes[cpu])
+    addresses[depth++] = s_nodeframes[cpu];
+#endif
+  return depth;
+}
+
+/** Return the number of the system call the interrupted context @a ctx
+    of a signal was in or just returned from, or -1 if it was not at a
+    system call instruction.  Right at the instruction, as when the
+    kernel restarts an interrupted call, the number is in the register
+    passing it.  On x86-64 that register has the result once the call
+    returns, so the number is then recovered from the instruction
+    loading it before the system call instruction.  */
+static int
+syscallNumber(void *ctx)
+{
+#if __linux && __x86_64__
+  ucontext_t *uc = (ucontext_t *) ctx;
+  const unsigned char *pc = (const unsigned char *) uc->uc_mcontext.gregs[REG_RIP];
+  size_t avail = (uintptr_t) pc & 4095;
+  if (pc[0] == 0x0f && pc[1] == 0x05)
+    return (int) uc->uc_mcontext.gregs[REG_RAX];
+  if (avail < 4 || pc[-2] != 0x0f || pc[-1] != 0x05)
+    return -1;
+
+  // "xor %eax,%eax" or "mov $NR,%rax" right before the system call,
+  // else the closest "mov $NR,%eax" a few instructions before it.
+  // Do not look back past the start of the page.
+  if (pc[-4] == 0x31 && pc[-3] == 0xc0)
+    return 0;
+  if (avail >= 9 && pc[-9] == 0x48 && pc[-8] == 0xc7 && pc[-7] == 0xc0)
+    return pc[-6] | (pc[-5] << 8) | (pc[-4] << 16) | (pc[-3] << 24);
+  for (size_t back = 7; back <= 20 && back <= avail; ++back)
+    if (pc[-back] == 0xb8 && ! pc[-back+3] && ! pc[-back+4])
+      return pc[-back+1] | (pc[-back+2] << 8);
+#elif __linux && __aarch64__
+  // The number stays in x8 across the "svc #0" instruction.
+  ucontext_t *uc = (ucontext_t *) ctx;
+  const uint32_t *pc = (const uint32_t *) uc->uc_mcontext.pc;
+  if (pc[0] == 0xd4000001 || (((uintptr_t) pc & 4095) >= 4 && pc[-1] == 0xd4000001))
+    return (int) uc->uc_mcontext.regs[8];
+#endif
+  return -1;
+}
+
+/** Insert a synthetic "syscall:NAME" leaf frame into the stack trace
+    of @a depth frames in @a addresses if the interrupted context @a ctx
+    was in a system call.  Returns the new stack depth.  */
+static int
+insertSyscall(void **addresses, int depth, int maxdepth, void *ctx)
+{
+  int nr = syscallNumber(ctx);
+  if (nr < 0 || nr >= MAX_SYSCALLS || ! s_syscallframes[nr])
+    return depth;
+
+  if (depth == maxdepth)
+    --depth;
+  memmove(&addresses[1], &addresses[0], depth * sizeof(void *));
+  addresses[0] = s_syscallframes[nr];
+  return depth + 1;
+}
+
+/** Append a sample of @a depth stack @a addresses to the ring of the
+    calling thread.  Called from the signal handler, so only copies
+    the sample without taking any locks.  Drops the sample if the ring
+    is full.  */
+static void
+queueSample(void **addresses, int depth, int weight, int wallweight,
+            uint64_t cycles)
+{
+  PerfRing *ring = (PerfRing *) pthread_getspecific(s_ringkey);
+  if (UNLIKELY(! ring))
+    return;
+
+  if (depth < 0)
+    depth = 0;
+
+  uint64_t mask = s_ringsize - 1;
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail + RING_HEADER + depth > s_ringsize)
+  {
+    ++ring->dropped;
+    return;
+  }
+
+  ring->data[head++ & mask] = (void *) (uintptr_t) depth;
+  ring->data[head++ & mask] = (void *) (uintptr_t) weight;
+  ring->data[head++ & mask] = (void *) (uintptr_t) wallweight;
+  ring->data[head++ & mask] = (void *) (uintptr_t) cycles;
+  for (int i = 0; i < depth; ++i)
+    ring->data[head++ & mask] = addresses[i];
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+/** Move all samples queued in the rings of all threads into the
+    collector's profile buffer, and free the rings of threads which
+    have exited.  */
+static void
+drainRings(void)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  IgProfTrace *buf = s_collectorbuf;
+  uint64_t mask = s_ringsize - 1;
+  if (! buf)
+    return;
+
+  pthread_mutex_lock(&s_drainlock);
+  pthread_mutex_lock(&s_ringlock);
+  for (PerfRing **link = &s_rings, *ring; (ring = *link); )
+  {
+    bool dead = ring->dead;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+
+    buf->lock();
+    while (tail < head)
+    {
+      int depth = (int) (uintptr_t) ring->data[tail++ & mask];
+      int weight = (int) (uintptr_t) ring->data[tail++ & mask];
+      int wallweight = (int) (uintptr_t) ring->data[tail++ & mask];
+      uint64_t cycles = (uintptr_t) ring->data[tail++ & mask];
+      for (int i = 0; i < depth; ++i)
+        addresses[i] = ring->data[tail++ & mask];
+
+      IgProfTrace::Stack *frame = buf->push(addresses, depth);
+      if (weight)
+        buf->tick(frame, &s_ct_ticks, weight, 1);
+      if (wallweight)
+        buf->tick(frame, &s_ct_wall, wallweight, 1);
+      buf->traceperf(depth+2, 0, cycles);
+    }
+    buf->unlock();
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    if (dead)
+    {
+      if (ring->dropped)
+        igprof_debug("performance profiler: dropped %lu samples"
+                     " of an exited thread on full ring\n",
+                     (unsigned long) ring->dropped);
+      *link = ring->next;
+      delete [] ring->data;
+      delete ring;
+    }
+    else
+      link = &ring->next;
+  }
+  pthread_mutex_unlock(&s_ringlock);
+  pthread_mutex_unlock(&s_drainlock);
+}
+
+/** Mark a thread's sample ring dead on thread exit.  The collector
+    frees it once it has drained the remaining samples. */
+static void
+releaseRing(void *arg)
+{
+  pthread_mutex_lock(&s_ringlock);
+  ((PerfRing *) arg)->dead = true;
+  pthread_mutex_unlock(&s_ringlock);
+}
+
 /** Performance profiler signal handler, SIGPROF or SIGALRM depending
-    on the current profiler mode.  Record a tick for the current
-    program location.  Assumes the signal handler is registered for
-    the correct thread.  Skip ticks when this profiler is not
-    enabled.  */
+    on the current profiler mode, or a real-time signal for per-thread
+    timers.  Record a tick for the current program location in the
+    counter for the clock which fired, weighted by the number of timer
+    expirations the kernel folded into this signal.  Assumes the
+    signal handler is registered for the correct thread.  Skip ticks
+    when this profiler is not enabled.  With an overhead budget the
+    tick is also weighted by the current sampling interval, so totals
+    stay in units of the configured period.  */
 static void
-profileSignalHandler(int /* nsig */, siginfo_t * /* info */, void * /* ctx */)
+profileSignalHandler(int nsig, siginfo_t *info, void *ctx)
 {
   void *addresses[IgProfTrace::MAX_DEPTH];
   if (LIKELY(igprof_disable()))
@@ -59,48 +500,500 @@ profileSignalHandler(int /* nsig */, siginfo_t * /* info */, void * /* ctx */)
     if (LIKELY(buf))
     {
       IgProfTrace::Stack *frame;
-      uint64_t tstart, tend;
+      uint64_t tenter = 0, tstart, tend;
+      bool wall = (s_wall && nsig == s_wallsignal);
+      long scale = 1;
       int depth;
+      int weight = 1;
+      int wallweight = 0;
+
+      if (s_budget)
+        tenter = budgetClock();
+#if __linux
+      if (s_threadtimer && info && info->si_code == SI_TIMER
+          && info->si_overrun > 0)
+        weight += info->si_overrun;
+#endif
+      if ((s_budget || s_regionperiod) && ! s_sampler)
+        weight *= (scale = timerScale());
+      if (wall)
+      {
+        wallweight = weight;
+        weight = 0;
+      }
+#if __linux
+      // The sampler thread passes the weights with the signal.
+      if (s_sampler && info && info->si_code == SI_QUEUE)
+      {
+        uintptr_t value = (uintptr_t) info->si_value.sival_ptr;
+        weight = value & 0xffff;
+        wallweight = value >> 16;
+      }
+#endif
 
       RDTSC(tstart);
       depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
       RDTSC(tend);
 
       // Drop top two stackframes (me, signal frame).
-      buf->lock();
-      frame = buf->push(addresses+2, depth-2);
-      buf->tick(frame, &s_ct_ticks, 1, 1);
-      buf->traceperf(depth, tstart, tend);
-      buf->unlock();
+      if (s_syscall && depth > 2)
+        depth = insertSyscall(addresses+2, depth-2,
+                              IgProfTrace::MAX_DEPTH-2, ctx) + 2;
+      if (depth > 2)
+        depth = insertRegions(addresses+2, depth-2,
+                              IgProfTrace::MAX_DEPTH-2) + 2;
+      if (s_cpu && depth > 2)
+        depth = insertCpu(addresses+2, depth-2,
+                          IgProfTrace::MAX_DEPTH-2) + 2;
+      if (s_async)
+        queueSample(addresses+2, depth-2, weight, wallweight, tend - tstart);
+      else
+      {
+        buf->lock();
+        frame = buf->push(addresses+2, depth-2);
+        if (weight)
+          buf->tick(frame, &s_ct_ticks, weight, 1);
+        if (wallweight)
+          buf->tick(frame, &s_ct_wall, wallweight, 1);
+        buf->traceperf(depth, tstart, tend);
+        buf->unlock();
+      }
+
+      if (s_budget)
+        adjustBudget(tenter, scale);
     }
   }
   igprof_enable();
 }
 
-/** Enable profiling timer.  You should have called
+#if __linux
+/** Return the per-thread profiling timers of the calling thread, or
+    null if the thread has none. */
+static inline PerfThreadTimers *
+threadTimers(void)
+{
+  return (PerfThreadTimers *) pthread_getspecific(s_timerkey);
+}
+
+/** Delete the per-thread profiling timers on thread exit. */
+static void
+freeThreadTimers(void *arg)
+{
+  PerfThreadTimers *timers = (PerfThreadTimers *) arg;
+  timer_delete(timers->cpu);
+  if (timers->haswall)
+    timer_delete(timers->wall);
+  delete timers;
+}
+
+/** Create a timer on @a clock for the calling thread which delivers
+    signal @a sig to this very thread.  Returns @c true on success. */
+static bool
+createThreadTimer(clockid_t clock, int sig, timer_t *timer)
+{
+  sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = sig;
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (timer_create(clock, &sev, timer) == 0)
+    return true;
+
+  igprof_debug("failed to create timer for signal %d in thread 0x%lx: %s\n",
+               sig, (unsigned long) pthread_self(), strerror(errno));
+  return false;
+}
+
+/** Create the profiling timers for the calling thread: a cpu-time
+    timer, plus a wall-clock timer if requested.  Returns the timers,
+    or null if the kernel refused to create the cpu timer. */
+static PerfThreadTimers *
+createThreadTimers(void)
+{
+  PerfThreadTimers *timers = threadTimers();
+  if (! timers)
+  {
+    timers = new PerfThreadTimers;
+    pthread_setspecific(s_timerkey, timers);
+  }
+
+  if (! createThreadTimer(CLOCK_THREAD_CPUTIME_ID, s_signal, &timers->cpu))
+  {
+    pthread_setspecific(s_timerkey, 0);
+    delete timers;
+    return 0;
+  }
+
+  timers->haswall = (s_wall
+                     && createThreadTimer(CLOCK_MONOTONIC, s_wallsignal,
+                                          &timers->wall));
+  return timers;
+}
+#endif
+
+/** Read the profiling timer of the calling thread, the wall-clock one
+    if @a wall is set.  Returns zero on success like getitimer(). */
+static int
+getTimer(itimerval *value, bool wall)
+{
+#if __linux
+  if (s_threadtimer)
+  {
+    itimerspec spec;
+    PerfThreadTimers *timers = threadTimers();
+    memset(value, 0, sizeof(*value));
+    if (! timers || (wall && ! timers->haswall)
+        || timer_gettime(wall ? timers->wall : timers->cpu, &spec) != 0)
+      return -1;
+
+    value->it_interval.tv_sec = spec.it_interval.tv_sec;
+    value->it_interval.tv_usec = spec.it_interval.tv_nsec / 1000;
+    value->it_value.tv_sec = spec.it_value.tv_sec;
+    value->it_value.tv_usec = spec.it_value.tv_nsec / 1000;
+    return 0;
+  }
+#endif
+  return getitimer(wall ? ITIMER_REAL : s_itimer, value);
+}
+
+/** Set the profiling timer of the calling thread to @a value, and
+    return the previous setting in @a ovalue if non-null.  Sets the
+    wall-clock timer if @a wall is set. */
+static void
+setTimer(const itimerval *value, itimerval *ovalue, bool wall)
+{
+#if __linux
+  if (s_threadtimer)
+  {
+    itimerspec spec, ospec;
+    PerfThreadTimers *timers = threadTimers();
+    if (ovalue)
+      memset(ovalue, 0, sizeof(*ovalue));
+    if (! timers || (wall && ! timers->haswall))
+      return;
+
+    spec.it_interval.tv_sec = value->it_interval.tv_sec;
+    spec.it_interval.tv_nsec = value->it_interval.tv_usec * 1000;
+    spec.it_value.tv_sec = value->it_value.tv_sec;
+    spec.it_value.tv_nsec = value->it_value.tv_usec * 1000;
+    if (timer_settime(wall ? timers->wall : timers->cpu, 0, &spec, &ospec) == 0
+        && ovalue)
+    {
+      ovalue->it_interval.tv_sec = ospec.it_interval.tv_sec;
+      ovalue->it_interval.tv_usec = ospec.it_interval.tv_nsec / 1000;
+      ovalue->it_value.tv_sec = ospec.it_value.tv_sec;
+      ovalue->it_value.tv_usec = ospec.it_value.tv_nsec / 1000;
+    }
+    return;
+  }
+#endif
+  setitimer(wall ? ITIMER_REAL : s_itimer, value, ovalue);
+}
+
+/** Choose the size of the per-thread sample rings, unless given as an
+    option, to hold the samples of #RING_LAG_US at the fastest sampling
+    rate with stacks #RING_TYPICAL deep, so a thread loses no samples
+    if the collector falls that far behind.  The size is rounded up to
+    a power of two between #RING_MIN, enough for the deepest stack,
+    and #RING_MAX.  */
+static void
+initRingSize(void)
+{
+  size_t words = s_ringsize;
+  if (! words)
+  {
+    long period = (s_regionperiod && s_regionperiod < s_period
+                   ? s_regionperiod : s_period);
+    words = (RING_LAG_US / period + 1) * (RING_HEADER + RING_TYPICAL);
+  }
+
+  s_ringsize = RING_MIN;
+  while (s_ringsize < words && s_ringsize < RING_MAX)
+    s_ringsize *= 2;
+}
+
+/** Create the sample ring of the calling thread for asynchronous
+    aggregation and register it for the collector. */
+static void
+addRing(void)
+{
+  PerfRing *ring = new PerfRing;
+  ring->data = new void *[s_ringsize];
+  ring->head = ring->tail = ring->dropped = 0;
+  ring->dead = false;
+  pthread_setspecific(s_ringkey, ring);
+
+  pthread_mutex_lock(&s_ringlock);
+  ring->next = s_rings;
+  s_rings = ring;
+  pthread_mutex_unlock(&s_ringlock);
+}
+
+static void leaveSampling(void);
+
+#if __linux
+/** Return the current time of @a clock in nanoseconds, or zero if
+    the clock cannot be read. */
+static inline uint64_t
+clockNs(clockid_t clock)
+{
+  timespec ts;
+  if (clock_gettime(clock, &ts) != 0)
+    return 0;
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** Register the calling thread with the sampler thread. */
+static void
+addSampled(void)
+{
+  PerfSampled *t = new PerfSampled;
+  t->thread = pthread_self();
+  if (pthread_getcpuclockid(t->thread, &t->clock) != 0)
+    t->clock = CLOCK_THREAD_CPUTIME_ID;
+  t->cpu = clockNs(t->clock);
+  t->wall = clockNs(CLOCK_MONOTONIC);
+  pthread_setspecific(s_sampledkey, t);
+
+  pthread_mutex_lock(&s_samplelock);
+  t->next = s_sampled;
+  s_sampled = t;
+  ++s_nsampled;
+  pthread_mutex_unlock(&s_samplelock);
+}
+
+/** Remove a thread from the sampler thread on thread exit. */
+static void
+removeSampled(void *arg)
+{
+  PerfSampled *t = (PerfSampled *) arg;
+  pthread_mutex_lock(&s_samplelock);
+  for (PerfSampled **link = &s_sampled; *link; link = &(*link)->next)
+    if (*link == t)
+    {
+      *link = t->next;
+      if (s_cursor == t)
+        s_cursor = t->next;
+      --s_nsampled;
+      break;
+    }
+  pthread_mutex_unlock(&s_samplelock);
+  delete t;
+}
+
+/** Signal the next few threads in turn to take a sample.  Sends each
+    thread the cpu and, if requested, wall clock time it has used since
+    it was last signalled, in units of the sampling period.  Threads
+    which have not run for a full period are skipped unless measuring
+    wall clock time.  At most #s_sampler threads are signalled, and
+    four times as many examined.  */
+static void
+sampleThreads(void)
+{
+  uint64_t unit = s_period * 1000ull;
+  uint64_t now = clockNs(CLOCK_MONOTONIC);
+  int nsent = 0;
+
+  pthread_mutex_lock(&s_samplelock);
+  for (int i = 0; i < s_nsampled && i < 4 * s_sampler && nsent < s_sampler; ++i)
+  {
+    if (! s_cursor)
+      s_cursor = s_sampled;
+
+    PerfSampled *t = s_cursor;
+    s_cursor = t->next;
+
+    uint64_t cpu = clockNs(t->clock);
+    uint64_t ncpu = (cpu > t->cpu ? (cpu - t->cpu) / unit : 0);
+    uint64_t nwall = (s_wall && now > t->wall ? (now - t->wall) / unit : 0);
+    if (ncpu > 0xffff)
+      ncpu = 0xffff;
+    if (nwall > 0xffff)
+      nwall = 0xffff;
+    if (! ncpu && ! nwall)
+      continue;
+
+    sigval value;
+    value.sival_ptr = (void *) (uintptr_t) (ncpu | (nwall << 16));
+    if (pthread_sigqueue(t->thread, s_signal, value) == 0)
+    {
+      t->cpu += ncpu * unit;
+      t->wall += nwall * unit;
+      ++nsent;
+    }
+  }
+  pthread_mutex_unlock(&s_samplelock);
+}
+
+/** Sampler thread.  Wakes up every sampling period and signals some
+    of the profiled threads to take a sample, so the cost grows with
+    the sampling rate rather than with the number of threads.  */
+static void *
+runSampler(void *)
+{
+  leaveSampling();
+  igprof_debug("performance profiler: sampling %d threads every %ld us"
+               " from thread 0x%lx\n", s_sampler, s_period,
+               (unsigned long) pthread_self());
+
+  timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (true)
+  {
+    next.tv_nsec += s_period * 1000;
+    next.tv_sec += next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) == EINTR)
+      ;
+
+    // Do not try to catch up if we fell far behind.
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > next.tv_sec + 1)
+      next = now;
+
+    sampleThreads();
+  }
+
+  return 0;
+}
+#endif
+
+/** Start a profiler thread running @a func, returning @c true on
+    success. */
+static bool
+startThread(void *(*func)(void *))
+{
+  pthread_t tid;
+  if (pthread_create(&tid, 0, func, 0) != 0)
+    return false;
+  pthread_detach(tid);
+  return true;
+}
+
+/** Exclude the calling profiler internal thread from profiling: stop
+    its timers or remove it from the sampler, and block the profiling
+    signals.  */
+static void
+leaveSampling(void)
+{
+  igprof_disable();
+#if __linux
+  if (PerfSampled *t = (PerfSampled *) pthread_getspecific(s_sampledkey))
+  {
+    pthread_setspecific(s_sampledkey, 0);
+    removeSampled(t);
+  }
+  else if (s_threadtimer)
+    setScale(0);
+#endif
+
+  sigset_t profset;
+  sigemptyset(&profset);
+  sigaddset(&profset, s_signal);
+  if (s_wall)
+    sigaddset(&profset, s_wallsignal);
+  if (dopthread_sigmask_hook_main.typed.chain)
+    (*dopthread_sigmask_hook_main.typed.chain)(SIG_BLOCK, &profset, 0);
+  else
+    pthread_sigmask(SIG_BLOCK, &profset, 0);
+}
+
+/** Collector thread for asynchronous aggregation.  Periodically moves
+    the samples queued by the signal handlers into the profile buffer
+    of this thread, so the profiled threads never touch a call tree.
+    The collector itself is not profiled.  */
+static void *
+collectSamples(void *)
+{
+  leaveSampling();
+  s_collectorbuf = igprof_buffer();
+  igprof_debug("performance profiler: collecting samples in thread 0x%lx\n",
+               (unsigned long) pthread_self());
+  while (true)
+  {
+    drainRings();
+    usleep(1000);
+  }
+
+  return 0;
+}
+
+/** Start the collector thread for asynchronous aggregation. */
+static void
+startCollector(void)
+{
+  if (! startThread(&collectSamples))
+  {
+    igprof_debug("performance profiler: cannot start sample collector,"
+                 " aggregating in signal handler\n");
+    s_async = false;
+  }
+}
+
+/** Enable profiling timers.  You should have called
     #enableSignalHandler() before calling this function.
     This needs to be executed in every thread to be profiled. */
 static void
 enableTimer(void)
 {
-  itimerval interval = { { 0, 5000 }, { 0, 5000 } };
-  setitimer(s_itimer, &interval, 0);
+#if __linux
+  if (s_sampler)
+  {
+    if (! pthread_getspecific(s_sampledkey))
+      addSampled();
+  }
+  else if (s_threadtimer && ! createThreadTimers())
+    return;
+#endif
+  if (s_budget && ! pthread_getspecific(s_budgetkey))
+  {
+    PerfBudget *budget = new PerfBudget;
+    memset(budget, 0, sizeof(*budget));
+    pthread_setspecific(s_budgetkey, budget);
+  }
+  if (s_async && ! pthread_getspecific(s_ringkey))
+    addRing();
+  setScale(s_basescale);
 }
 
-/** Enable profiling signal handler.  */
+/** Install profiling signal handler for signal @a sig.  */
 static void
-enableSignalHandler(void)
+enableSignalHandler(int sig)
 {
   sigset_t profset;
   sigemptyset(&profset);
-  sigaddset(&profset, s_signal);
+  sigaddset(&profset, sig);
   pthread_sigmask(SIG_UNBLOCK, &profset, 0);
 
   struct sigaction sa;
   sigemptyset(&sa.sa_mask);
   sa.sa_sigaction = &profileSignalHandler;
   sa.sa_flags = SA_RESTART | SA_SIGINFO;
-  sigaction(s_signal, &sa, 0);
+  sigaction(sig, &sa, 0);
+}
+
+/** Enable profiling signal handlers.  */
+static void
+enableSignalHandler(void)
+{
+  enableSignalHandler(s_signal);
+  if (s_wall)
+    enableSignalHandler(s_wallsignal);
+}
+
+/** Delete the overhead budget state on thread exit. */
+static void
+freeBudget(void *arg)
+{
+  delete (PerfBudget *) arg;
+}
+
+/** Delete the marked region state on thread exit. */
+static void
+freeRegions(void *arg)
+{
+  delete (PerfRegionStack *) arg;
 }
 
 /** Thread setup function.  */
@@ -112,6 +1005,148 @@ threadInit(void)
   enableTimer();
 }
 
+/** Create the synthetic "cpu:N" frames for every cpu, and if the
+    system has more than one NUMA node, the "node:K" frames for the
+    node of each cpu.  */
+static void
+initCpuFrames(void)
+{
+#if __linux
+  int cpunode[MAX_CPUS];
+  char name[64];
+  long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  bool numa = false;
+
+  if (ncpus > MAX_CPUS)
+    ncpus = MAX_CPUS;
+
+  for (long cpu = 0; cpu < ncpus; ++cpu)
+  {
+    cpunode[cpu] = -1;
+    snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%ld", cpu);
+    if (DIR *dir = opendir(name))
+    {
+      while (dirent *entry = readdir(dir))
+        if (! strncmp(entry->d_name, "node", 4)
+            && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+          cpunode[cpu] = atoi(entry->d_name + 4);
+      closedir(dir);
+    }
+
+    if (cpunode[cpu] >= 0 && cpunode[cpu] != cpunode[0])
+      numa = true;
+
+    snprintf(name, sizeof(name), "cpu:%ld", cpu);
+    s_cpuframes[cpu] = igprof_synthetic_frame(name);
+  }
+
+  for (long cpu = 0; numa && cpu < ncpus; ++cpu)
+    if (cpunode[cpu] >= 0)
+    {
+      snprintf(name, sizeof(name), "node:%d", cpunode[cpu]);
+      s_nodeframes[cpu] = igprof_synthetic_frame(name);
+    }
+
+  igprof_debug("performance profiler: attributing samples to %ld cpus%s\n",
+               ncpus, numa ? " and their numa nodes" : "");
+#endif
+}
+
+/** Create the synthetic "syscall:NAME" frames for every system call
+    number, named "syscall:NR" if the name is not known here.  */
+static void
+initSyscallFrames(void)
+{
+#if __linux
+  static const struct { int nr; const char *name; } names[] = {
+    { SYS_read, "read" }, { SYS_write, "write" }, { SYS_openat, "openat" },
+    { SYS_close, "close" }, { SYS_fstat, "fstat" }, { SYS_newfstatat, "newfstatat" },
+    { SYS_lseek, "lseek" }, { SYS_mmap, "mmap" }, { SYS_mprotect, "mprotect" },
+    { SYS_munmap, "munmap" }, { SYS_mremap, "mremap" }, { SYS_madvise, "madvise" },
+    { SYS_msync, "msync" }, { SYS_mlock, "mlock" }, { SYS_munlock, "munlock" },
+    { SYS_brk, "brk" }, { SYS_rt_sigaction, "rt_sigaction" },
+    { SYS_rt_sigprocmask, "rt_sigprocmask" }, { SYS_rt_sigreturn, "rt_sigreturn" },
+    { SYS_ioctl, "ioctl" }, { SYS_pread64, "pread64" }, { SYS_pwrite64, "pwrite64" },
+    { SYS_readv, "readv" }, { SYS_writev, "writev" }, { SYS_preadv, "preadv" },
+    { SYS_pwritev, "pwritev" }, { SYS_sched_yield, "sched_yield" },
+    { SYS_sched_getaffinity, "sched_getaffinity" },
+    { SYS_sched_setaffinity, "sched_setaffinity" }, { SYS_dup, "dup" },
+    { SYS_dup3, "dup3" }, { SYS_pipe2, "pipe2" }, { SYS_nanosleep, "nanosleep" },
+    { SYS_clock_nanosleep, "clock_nanosleep" }, { SYS_clock_gettime, "clock_gettime" },
+    { SYS_gettimeofday, "gettimeofday" }, { SYS_getpid, "getpid" },
+    { SYS_gettid, "gettid" }, { SYS_sendfile, "sendfile" }, { SYS_socket, "socket" },
+    { SYS_connect, "connect" }, { SYS_accept, "accept" }, { SYS_accept4, "accept4" },
+    { SYS_bind, "bind" }, { SYS_listen, "listen" }, { SYS_shutdown, "shutdown" },
+    { SYS_sendto, "sendto" }, { SYS_recvfrom, "recvfrom" }, { SYS_sendmsg, "sendmsg" },
+    { SYS_recvmsg, "recvmsg" }, { SYS_sendmmsg, "sendmmsg" }, { SYS_recvmmsg, "recvmmsg" },
+    { SYS_getsockopt, "getsockopt" }, { SYS_setsockopt, "setsockopt" },
+    { SYS_clone, "clone" }, { SYS_execve, "execve" }, { SYS_exit, "exit" },
+    { SYS_exit_group, "exit_group" }, { SYS_wait4, "wait4" }, { SYS_kill, "kill" },
+    { SYS_tgkill, "tgkill" }, { SYS_fcntl, "fcntl" }, { SYS_flock, "flock" },
+    { SYS_fsync, "fsync" }, { SYS_fdatasync, "fdatasync" },
+    { SYS_sync_file_range, "sync_file_range" }, { SYS_ftruncate, "ftruncate" },
+    { SYS_fallocate, "fallocate" }, { SYS_getdents64, "getdents64" },
+    { SYS_getcwd, "getcwd" }, { SYS_chdir, "chdir" }, { SYS_faccessat, "faccessat" },
+    { SYS_unlinkat, "unlinkat" }, { SYS_renameat, "renameat" }, { SYS_mkdirat, "mkdirat" },
+    { SYS_readlinkat, "readlinkat" }, { SYS_getrusage, "getrusage" },
+    { SYS_prlimit64, "prlimit64" }, { SYS_futex, "futex" },
+    { SYS_set_robust_list, "set_robust_list" }, { SYS_epoll_ctl, "epoll_ctl" },
+    { SYS_epoll_pwait, "epoll_pwait" }, { SYS_epoll_create1, "epoll_create1" },
+    { SYS_eventfd2, "eventfd2" }, { SYS_timerfd_settime, "timerfd_settime" },
+    { SYS_ppoll, "ppoll" }, { SYS_pselect6, "pselect6" }, { SYS_splice, "splice" },
+    { SYS_tee, "tee" }, { SYS_io_submit, "io_submit" },
+    { SYS_io_getevents, "io_getevents" }, { SYS_perf_event_open, "perf_event_open" },
+    { SYS_process_vm_readv, "process_vm_readv" },
+    { SYS_restart_syscall, "restart_syscall" },
+#ifdef SYS_getrandom
+    { SYS_getrandom, "getrandom" }, { SYS_memfd_create, "memfd_create" },
+    { SYS_membarrier, "membarrier" }, { SYS_copy_file_range, "copy_file_range" },
+#endif
+#ifdef SYS_statx
+    { SYS_statx, "statx" },
+#endif
+#ifdef SYS_io_uring_enter
+    { SYS_io_uring_enter, "io_uring_enter" },
+#endif
+#ifdef SYS_rseq
+    { SYS_rseq, "rseq" },
+#endif
+#ifdef SYS_clone3
+    { SYS_clone3, "clone3" },
+#endif
+#ifdef SYS_open
+    // Legacy calls not in the generic system call table.
+    { SYS_open, "open" }, { SYS_stat, "stat" }, { SYS_lstat, "lstat" },
+    { SYS_access, "access" }, { SYS_poll, "poll" }, { SYS_select, "select" },
+    { SYS_pipe, "pipe" }, { SYS_dup2, "dup2" }, { SYS_fork, "fork" },
+    { SYS_vfork, "vfork" }, { SYS_unlink, "unlink" }, { SYS_rename, "rename" },
+    { SYS_mkdir, "mkdir" }, { SYS_rmdir, "rmdir" }, { SYS_readlink, "readlink" },
+    { SYS_getdents, "getdents" }, { SYS_epoll_wait, "epoll_wait" },
+    { SYS_epoll_create, "epoll_create" }, { SYS_pause, "pause" },
+    { SYS_alarm, "alarm" },
+#endif
+  };
+  const char *known[MAX_SYSCALLS] = { 0 };
+  char name[64];
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    if (names[i].nr >= 0 && names[i].nr < MAX_SYSCALLS)
+      known[names[i].nr] = names[i].name;
+
+  for (int nr = 0; nr < MAX_SYSCALLS; ++nr)
+  {
+    if (known[nr])
+      snprintf(name, sizeof(name), "syscall:%s", known[nr]);
+    else
+      snprintf(name, sizeof(name), "syscall:%d", nr);
+    s_syscallframes[nr] = igprof_synthetic_frame(name);
+  }
+
+  igprof_debug("performance profiler: attributing samples in system"
+               " calls to the calls\n");
+#endif
+}
+
 // -------------------------------------------------------------------
 /** Possibly start performance profiler.  */
 static void
@@ -153,6 +1188,80 @@ initialize(void)
           s_itimer = ITIMER_PROF;
           options += 7;
         }
+        else if (! strncmp(options, ":thread", 7))
+        {
+#if __linux
+          s_threadtimer = true;
+#endif
+          options += 7;
+        }
+        else if (! strncmp(options, ":wall", 5))
+        {
+          s_wall = true;
+          options += 5;
+        }
+        else if (! strncmp(options, ":hz=", 4))
+        {
+          options += 4;
+          long hz = strtol(options, const_cast<char **>(&options), 10);
+          if (hz == 0)
+            s_period = 0;
+          else if (hz > 0 && hz <= 1000000)
+            s_period = 1000000 / hz;
+        }
+        else if (! strncmp(options, ":region=", 8))
+        {
+          options += 8;
+          long hz = strtol(options, const_cast<char **>(&options), 10);
+          if (hz > 0 && hz <= 1000000)
+            s_regionperiod = 1000000 / hz;
+        }
+        else if (! strncmp(options, ":budget=", 8))
+        {
+          options += 8;
+          double pct = strtod(options, const_cast<char **>(&options));
+          if (*options == '%')
+            ++options;
+          if (pct > 0 && pct < 100)
+            s_budget = (pct < 0.01 ? 1 : long(pct * 100 + 0.5));
+        }
+        else if (! strncmp(options, ":sampler", 8))
+        {
+          options += 8;
+          s_sampler = 16;
+          if (*options == '=')
+          {
+            ++options;
+            long n = strtol(options, const_cast<char **>(&options), 10);
+            if (n > 0 && n <= 100000)
+              s_sampler = n;
+          }
+        }
+        else if (! strncmp(options, ":cpu", 4))
+        {
+#if __linux
+          s_cpu = true;
+#endif
+          options += 4;
+        }
+        else if (! strncmp(options, ":syscall", 8))
+        {
+#if __linux && (__x86_64__ || __aarch64__)
+          s_syscall = true;
+#endif
+          options += 8;
+        }
+        else if (! strncmp(options, ":async", 6))
+        {
+          s_async = true;
+          options += 6;
+          if (*options == '=')
+          {
+            long kb = strtol(options+1, const_cast<char **>(&options), 10);
+            if (kb > 0)
+              s_ringsize = kb * 1024 / sizeof(void *);
+          }
+        }
         else if (! strncmp(options, ":keep", 5))
         {
           s_keep = true;
@@ -177,26 +1286,109 @@ initialize(void)
   if (! enable)
     return;
 
+  // When marked regions are sampled faster, ticks count in units of
+  // the region sampling period.  Outside regions the timers run at a
+  // multiple of it, or not at all if the base rate is zero.
+  if (s_regionperiod)
+  {
+    s_basescale = (s_period + s_regionperiod / 2) / s_regionperiod;
+    if (s_period && s_basescale < 1)
+      s_basescale = 1;
+    s_period = s_regionperiod;
+  }
+  else if (! s_period)
+    s_period = 5000;
+
+  // The wall clock gets its own timer, so the primary one has to
+  // measure cpu time.
+  if (s_wall && s_itimer == ITIMER_REAL)
+  {
+    s_signal = SIGPROF;
+    s_itimer = ITIMER_PROF;
+  }
+
   double clockres = 0;
-  itimerval precision;
-  itimerval interval = { { 0, 5000 }, { 100, 0 } };
-  itimerval nullified = { { 0, 0 }, { 0, 0 } };
-  setitimer(s_itimer, &interval, 0);
-  getitimer(s_itimer, &precision);
-  setitimer(s_itimer, &nullified, 0);
-  clockres = precision.it_interval.tv_sec
-             + 1e-6 * precision.it_interval.tv_usec;
-
-  if (! igprof_init("performance profiler", &threadInit, true, clockres))
+#if __linux
+  if (s_sampler)
+  {
+    // The sampler thread signals threads on a real-time signal, and
+    // passes the cpu and wall clock weights along with the signal.
+    s_threadtimer = false;
+    s_signal = SIGRTMIN + 3;
+    s_wallsignal = SIGRTMIN + 4;
+    clockres = 1e-6 * s_period;
+    pthread_key_create(&s_sampledkey, &removeSampled);
+  }
+  else
+#else
+  s_sampler = 0;
+#endif
+  if (s_threadtimer)
+  {
+#if __linux
+    // Per-thread timers fire on dedicated real-time signals the
+    // application is unlikely to use, and have no jiffy rounding.
+    s_signal = SIGRTMIN + 3;
+    s_wallsignal = SIGRTMIN + 4;
+    clockres = 1e-6 * s_period;
+    pthread_key_create(&s_timerkey, &freeThreadTimers);
+#endif
+  }
+  else
+  {
+    itimerval precision;
+    itimerval interval = { { s_period / 1000000, s_period % 1000000 }, { 100, 0 } };
+    itimerval nullified = { { 0, 0 }, { 0, 0 } };
+    setitimer(s_itimer, &interval, 0);
+    getitimer(s_itimer, &precision);
+    setitimer(s_itimer, &nullified, 0);
+    clockres = precision.it_interval.tv_sec
+               + 1e-6 * precision.it_interval.tv_usec;
+  }
+
+  if (! igprof_init("performance profiler", &threadInit, true, clockres,
+                    s_async ? &drainRings : 0))
     return;
 
   igprof_disable_globally();
-  if (s_itimer == ITIMER_REAL)
+  if (s_sampler)
+    igprof_debug("performance profiler: measuring per-thread cpu time"
+                 " with sampler thread on signal %d\n", s_signal);
+  else if (s_threadtimer)
+    igprof_debug("performance profiler: measuring per-thread cpu time"
+                 " on signal %d\n", s_signal);
+  else if (s_itimer == ITIMER_REAL)
     igprof_debug("performance profiler: measuring real time\n");
   else if (s_itimer == ITIMER_VIRTUAL)
     igprof_debug("performance profiler: measuring user time\n");
   else if (s_itimer == ITIMER_PROF)
     igprof_debug("performance profiler: measuring process cpu time\n");
+  if (s_wall)
+    igprof_debug("performance profiler: also measuring real time"
+                 " on signal %d\n", s_wallsignal);
+  if (s_regionperiod)
+    igprof_debug("performance profiler: sampling every %ld us in marked"
+                 " regions, every %ld us elsewhere\n",
+                 s_period, s_period * s_basescale);
+  pthread_key_create(&s_regionkey, &freeRegions);
+  if (s_cpu)
+    initCpuFrames();
+  if (s_syscall)
+    initSyscallFrames();
+  if (s_async)
+  {
+    initRingSize();
+    igprof_debug("performance profiler: aggregating samples asynchronously,"
+                 " %lu kB of sample ring per thread\n",
+                 (unsigned long) (s_ringsize * sizeof(void *) / 1024));
+    pthread_key_create(&s_ringkey, &releaseRing);
+  }
+  if (s_budget)
+  {
+    igprof_debug("performance profiler: keeping sampling overhead"
+                 " under %ld.%02ld%%\n", s_budget / 100, s_budget % 100);
+    pthread_key_create(&s_budgetkey, &freeBudget);
+  }
 
   // Enable profiler.
   IgHook::hook(dofork_hook_main.raw);
@@ -209,36 +1401,135 @@ initialize(void)
 #endif
   igprof_debug("performance profiler enabled\n");
 
+  s_enabled = true;
   enableSignalHandler();
   enableTimer();
+  if (s_async)
+    startCollector();
+#if __linux
+  if (s_sampler)
+    startThread(&runSampler);
+#endif
   if (enable_on_init)
     igprof_enable_globally();
 }
 
 // -------------------------------------------------------------------
-// Trap fiddling with thread signal masks
-static int
-dopthread_sigmask(IgHook::SafeData<igprof_dopthread_sigmask_t> &hook,
-                  int how, sigset_t *newmask,  sigset_t *oldmask)
+/** Enter a marked code region called @a name in the calling thread.
+    Until the matching igprof_region_exit(), performance profiler
+    samples in this thread are attributed to a synthetic frame
+    "region:NAME" inserted just below the calling function, and if a
+    region sampling rate was given, taken at that rate.  Regions can
+    be nested.  Does nothing unless the performance profiler is on.  */
+extern "C" VISIBLE void
+igprof_region_enter(const char *name)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  char fullname[256];
+  if (! s_enabled || ! name)
+    return;
+
+  igprof_disable();
+  PerfRegionStack *regions = threadRegions();
+  if (! regions)
+  {
+    regions = new PerfRegionStack;
+    regions->depth = 0;
+    regions->overflow = 0;
+    pthread_setspecific(s_regionkey, regions);
+  }
+
+  void *frame = 0;
+  if (regions->depth < MAX_REGIONS)
+  {
+    snprintf(fullname, sizeof(fullname), "region:%s", name);
+    frame = igprof_synthetic_frame(fullname);
+  }
+
+  if (frame)
+  {
+    // Drop this function from the entry depth.  Fill in the region
+    // before making it visible to the signal handler.
+    PerfRegion &region = regions->region[regions->depth];
+    region.frame = frame;
+    region.depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH) - 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (++regions->depth == 1 && s_regionperiod)
+      setScale(1);
+  }
+  else
+    ++regions->overflow;
+  igprof_enable();
+}
+
+/** Leave the innermost marked code region entered in the calling
+    thread with igprof_region_enter().  When the last region is left,
+    returns to the base sampling rate.  */
+extern "C" VISIBLE void
+igprof_region_exit(void)
+{
+  PerfRegionStack *regions;
+  if (! s_enabled || ! (regions = threadRegions()))
+    return;
+
+  igprof_disable();
+  if (regions->overflow > 0)
+    --regions->overflow;
+  else if (regions->depth > 0
+           && --regions->depth == 0
+           && s_regionperiod)
+    setScale(s_basescale);
+  igprof_enable();
+}
+
+// -------------------------------------------------------------------
+/** Check if the calling thread is signalled by the sampler thread. */
+static inline bool
+isSampled(void)
+{
+#if __linux
+  return s_sampler && pthread_getspecific(s_sampledkey);
+#else
+  return false;
+#endif
+}
+
+/** Remove profiling signal @a sig from @a mask if the profiler timer
+    for it is active in this thread. */
+static void
+keepSignalUnblocked(sigset_t *mask, int sig, bool wall)
 {
   struct sigaction cursig;
-  struct itimerval curtimer;
-  if (newmask
-      && (how == SIG_BLOCK || how == SIG_SETMASK)
-      && sigismember(newmask, s_signal)
-      && sigaction(s_signal, 0, &cursig) == 0
+  struct itimerval curtimer = { { 0, 0 }, { 0, 0 } };
+  if (sigismember(mask, sig)
+      && sigaction(sig, 0, &cursig) == 0
       && cursig.sa_handler
-      && getitimer(s_itimer, &curtimer) == 0
-      && (curtimer.it_interval.tv_sec || curtimer.it_interval.tv_usec))
+      && (isSampled()
+          || (getTimer(&curtimer, wall) == 0
+              && (curtimer.it_interval.tv_sec
+                  || curtimer.it_interval.tv_usec))))
   {
     igprof_debug("pthread_sigmask(): prevented profiling signal"
                  " %d from being blocked in thread 0x%lx"
                  " [handler 0x%lx, interval %.0f us]\n",
-                 s_signal, (unsigned long) pthread_self(),
+                 sig, (unsigned long) pthread_self(),
                  (unsigned long) cursig.sa_handler,
                  1e6 * curtimer.it_interval.tv_sec
                  + curtimer.it_interval.tv_usec);
-    sigdelset(newmask, s_signal);
+    sigdelset(mask, sig);
+  }
+}
+
+// Trap fiddling with thread signal masks
+static int
+dopthread_sigmask(IgHook::SafeData<igprof_dopthread_sigmask_t> &hook,
+                  int how, sigset_t *newmask,  sigset_t *oldmask)
+{
+  if (newmask && (how == SIG_BLOCK || how == SIG_SETMASK))
+  {
+    keepSignalUnblocked(newmask, s_signal, false);
+    if (s_wall)
+      keepSignalUnblocked(newmask, s_wallsignal, true);
   }
 
   return hook.chain(how, newmask, oldmask);
@@ -250,13 +1541,13 @@ dosigaction(IgHook::SafeData<igprof_dosigaction_t> &hook,
             int signum, const struct sigaction *act, struct sigaction *oact)
 {
   struct sigaction sa;
-  if (signum == s_signal
+  if ((signum == s_signal || (s_wall && signum == s_wallsignal))
       && act
       && act->sa_sigaction != &profileSignalHandler)
   {
     igprof_debug("sigaction(): prevented profiling signal"
                  " %d from being overridden in thread 0x%lx\n",
-                 s_signal, (unsigned long) pthread_self());
+                 signum, (unsigned long) pthread_self());
     sigemptyset(&sa.sa_mask);
     sa.sa_sigaction = &profileSignalHandler;
     sa.sa_flags = SA_RESTART | SA_SIGINFO;
@@ -266,6 +1557,74 @@ dosigaction(IgHook::SafeData<igprof_dosigaction_t> &hook,
   return hook.chain(signum, act, oact);
 }
 
+/** State of a profiling timer slowed down around fork() or system(). */
+struct PerfTimerBlink
+{
+  itimerval     orig;
+  itimerval     slow;
+  double        dt;
+};
+
+/** Slow down a profiling timer to once per 10sec, which should be
+    slow enough to complete fork() under any circumstances. */
+static void
+slowTimer(PerfTimerBlink &blink, bool wall)
+{
+  itimerval slow = { { 10, 0 }, { 10, 0 } };
+  itimerval left = { { 0, 0 }, { 0, 0 } };
+  getTimer(&left, wall);
+  setTimer(&slow, &blink.orig, wall);
+  getTimer(&blink.slow, wall);
+  blink.dt = tv2sec(left.it_interval) - tv2sec(left.it_value);
+}
+
+/** Restore a profiling timer slowed down with slowTimer().  Returns
+    the number of ticks the timer would have generated meanwhile. */
+static int
+resumeTimer(PerfTimerBlink &blink, bool wall)
+{
+  itimerval fast = { { 0, 0 }, { 0, 0 } };
+  itimerval left = { { 0, 0 }, { 0, 0 } };
+  getTimer(&left, wall);
+  setTimer(&blink.orig, 0, wall);
+  getTimer(&fast, wall);
+  // With an overhead budget or marked regions the interval varies,
+  // count in units of the sampling period like the signal handler.
+  double ival = (s_budget || s_regionperiod
+                 ? 1e-6 * s_period : tv2sec(fast.it_interval));
+  if (! blink.orig.it_interval.tv_sec && ! blink.orig.it_interval.tv_usec)
+    return 0;
+  blink.dt += tv2sec(blink.slow.it_value) - tv2sec(left.it_value);
+  return (ival > 0 ? int(blink.dt / ival + 0.5) : 0);
+}
+
+/** Blame @a nticks of counter @a def on the call to the hooked
+    function @a original, replacing the hook frame in the stack. */
+static void __attribute__((noinline))
+chargeTicks(void *original, IgProfTrace::CounterDef *def, int nticks)
+{
+  IgProfTrace *buf;
+  if (nticks && (buf = igprof_buffer()))
+  {
+    void *addresses[IgProfTrace::MAX_DEPTH];
+    IgProfTrace::Stack *frame;
+    uint64_t tstart, tend;
+    int depth;
+
+    RDTSC(tstart);
+    depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+    RDTSC(tend);
+
+    // Drop this function, replace the hook frame with the original.
+    if (depth > 1) addresses[1] = original;
+    buf->lock();
+    frame = buf->push(addresses+1, depth-1);
+    buf->tick(frame, def, nticks, 1);
+    buf->traceperf(depth, tstart, tend);
+    buf->unlock();
+  }
+}
+
 // Trap fork to deactivate profiling around it, then artificially
 // add back the cost associated to actual fork call. This trickery
 // is required because large processes can take a rather long time
@@ -274,24 +1633,21 @@ dosigaction(IgHook::SafeData<igprof_dosigaction_t> &hook,
 static int
 dofork(IgHook::SafeData<igprof_dofork_t> &hook)
 {
-  // Slow down profiling to once per 10sec, which should be slow
-  // enough to complete fork() under any circumstances.
-  double ival;
-  double dt = 0;
-  int nticks = 0;
-  IgProfTrace *buf;
   bool enabled = igprof_disable();
-  itimerval orig;
-  itimerval slow = { { 10, 0 }, { 10, 0 } };
-  itimerval fast = { { 0, 5000 }, { 0, 5000 } };
-  itimerval left = { { 0, 0 }, { 0, 0 } };
-  getitimer(s_itimer, &left);
-  setitimer(s_itimer, &slow, &orig);
-  getitimer(s_itimer, &slow);
-  dt = tv2sec(left.it_interval) - tv2sec(left.it_value);
+  PerfTimerBlink cpu, wall;
+  int nticks = 0;
+  int nwallticks = 0;
+  slowTimer(cpu, false);
+  if (s_wall)
+    slowTimer(wall, true);
 
-  // Do the fork() call.
+  // Do the fork() call.  Make sure the collector is not in the middle
+  // of updating a profile buffer while we fork.
+  if (s_async)
+    pthread_mutex_lock(&s_drainlock);
   int ret = hook.chain();
+  if (s_async && ret != 0)
+    pthread_mutex_unlock(&s_drainlock);
 
   // Now calculate how much time we spent doing the fork, and blame
   // the actual system call for it, drop this frame out of stack.
@@ -299,41 +1655,70 @@ dofork(IgHook::SafeData<igprof_dofork_t> &hook)
   // Normally we reset profiles in child, but allow an override.
   if (ret >= 0)
   {
-    getitimer(s_itimer, &left);
-    setitimer(s_itimer, &orig, 0);
-    getitimer(s_itimer, &fast);
-    ival = tv2sec(fast.it_interval);
-    dt += tv2sec(slow.it_value) - tv2sec(left.it_value);
-    nticks = (ival > 0 ? int(dt / ival + 0.5) : 0);
+#if __linux
+    // Timers are not inherited by the child, create new ones.
+    if (ret == 0 && s_threadtimer)
+      createThreadTimers();
+#endif
+
+    // Neither are the other threads, including the collector.  Keep
+    // only this thread's ring and start a new collector.
+    if (ret == 0 && s_async)
+    {
+      PerfRing *ring = (PerfRing *) pthread_getspecific(s_ringkey);
+      pthread_mutex_init(&s_ringlock, 0);
+      pthread_mutex_init(&s_drainlock, 0);
+      s_rings = ring;
+      if (ring)
+      {
+        ring->next = 0;
+        if (! s_keep)
+          ring->tail = ring->head;
+      }
+      s_collectorbuf = 0;
+      startCollector();
+    }
+
+#if __linux
+    // Likewise the sampler thread, and this thread has new clocks.
+    if (ret == 0 && s_sampler)
+    {
+      PerfSampled *t = (PerfSampled *) pthread_getspecific(s_sampledkey);
+      pthread_mutex_init(&s_samplelock, 0);
+      s_sampled = s_cursor = t;
+      s_nsampled = (t ? 1 : 0);
+      if (t)
+      {
+        t->next = 0;
+        t->thread = pthread_self();
+        if (pthread_getcpuclockid(t->thread, &t->clock) != 0)
+          t->clock = CLOCK_THREAD_CPUTIME_ID;
+        t->cpu = clockNs(t->clock);
+        t->wall = clockNs(CLOCK_MONOTONIC);
+      }
+      startThread(&runSampler);
+    }
+#endif
+    nticks = resumeTimer(cpu, false);
+    if (s_wall)
+      nwallticks = resumeTimer(wall, true);
 
     if (ret == 0)
     {
-      dt = nticks = 0;
+      cpu.dt = nticks = nwallticks = 0;
       if (! s_keep)
         igprof_reset_profiles();
     }
 
-    if (enabled && nticks && (buf = igprof_buffer()))
+    if (enabled)
     {
-      void *addresses[IgProfTrace::MAX_DEPTH];
-      IgProfTrace::Stack *frame;
-      uint64_t tstart, tend;
-      int depth;
-
-      RDTSC(tstart);
-      depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
-      RDTSC(tend);
-
-      // Replace top stack frame (this hook) with the original.
-      if (depth > 0) addresses[0] = __extension__ (void *) hook.original;
-      frame = buf->push(addresses, depth);
-      buf->tick(frame, &s_ct_ticks, 1, nticks);
-      buf->traceperf(depth, tstart, tend);
+      chargeTicks(__extension__ (void *) hook.original, &s_ct_ticks, nticks);
+      chargeTicks(__extension__ (void *) hook.original, &s_ct_wall, nwallticks);
     }
 
     if (ret != 0)
       igprof_debug("resuming profiling after blinking for fork() for"
-		   " %.3fms, %d ticks\n", dt*1000, nticks);
+		   " %.3fms, %d ticks\n", cpu.dt*1000, nticks);
   }
 
   igprof_enable();
@@ -348,48 +1733,27 @@ static int
 dosystem(IgHook::SafeData<igprof_dosystem_t> &hook, const char *cmd)
 {
   // See fork() for the implementation details.
-  double ival;
-  double dt = 0;
-  int nticks = 0;
-  IgProfTrace *buf;
   bool enabled = igprof_disable();
-  itimerval orig;
-  itimerval slow = { { 10, 0 }, { 10, 0 } };
-  itimerval fast = { { 0, 5000 }, { 0, 5000 } };
-  itimerval left = { { 0, 0 }, { 0, 0 } };
-  getitimer(s_itimer, &left);
-  setitimer(s_itimer, &slow, &orig);
-  getitimer(s_itimer, &slow);
-  dt = tv2sec(left.it_interval) - tv2sec(left.it_value);
+  PerfTimerBlink cpu, wall;
+  int nticks = 0;
+  int nwallticks = 0;
+  slowTimer(cpu, false);
+  if (s_wall)
+    slowTimer(wall, true);
 
   int ret = hook.chain(cmd);
 
-  getitimer(s_itimer, &left);
-  setitimer(s_itimer, &orig, 0);
-  getitimer(s_itimer, &fast);
-  ival = tv2sec(fast.it_interval);
-  dt += tv2sec(slow.it_value) - tv2sec(left.it_value);
-  nticks = (ival > 0 ? int(dt / ival + 0.5) : 0);
-  if (enabled && nticks && (buf = igprof_buffer()))
+  nticks = resumeTimer(cpu, false);
+  if (s_wall)
+    nwallticks = resumeTimer(wall, true);
+  if (enabled)
   {
-    void *addresses[IgProfTrace::MAX_DEPTH];
-    IgProfTrace::Stack *frame;
-    uint64_t tstart, tend;
-    int depth;
-
-    RDTSC(tstart);
-    depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
-    RDTSC(tend);
-
-    // Replace top stack frame (this hook) with the original.
-    if (depth > 0) addresses[0] = __extension__ (void *) hook.original;
-    frame = buf->push(addresses, depth);
-    buf->tick(frame, &s_ct_ticks, 1, nticks);
-    buf->traceperf(depth, tstart, tend);
+    chargeTicks(__extension__ (void *) hook.original, &s_ct_ticks, nticks);
+    chargeTicks(__extension__ (void *) hook.original, &s_ct_wall, nwallticks);
   }
 
   igprof_debug("resuming profiling after blinking for system() for"
-	       " %.3fms, %d ticks\n", dt*1000, nticks);
+	       " %.3fms, %d ticks\n", cpu.dt*1000, nticks);
   igprof_enable();
   return ret;
 }
@@ -0,0 +1,238 @@
+#include "profile.h"
+#include "walk-syms.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <dlfcn.h>
+
+// -------------------------------------------------------------------
+// Data for this profiler module
+
+/** Where a CPython version keeps the current frame of a thread, and
+    the fields of frames, code objects and strings read here.  Byte
+    offsets for 64-bit builds.  Fields a version does not have are -1.  */
+struct HIDDEN PyLayout
+{
+  int           version;        //< Major and minor version, as 0x030b.
+  int           tstateFrame;    //< Thread state to frame, or to cframe.
+  int           cframeFrame;    //< Cframe to current frame.
+  int           frameCode;      //< Frame to code object.
+  int           frameBack;      //< Frame to calling frame.
+  int           frameEntry;     //< Frame to "entered from C" flag.
+  int           frameOwner;     //< Frame to owner kind.
+  int           codeFilename;   //< Code to file name.
+  int           codeName;       //< Code to qualified or plain name.
+  int           codeLine;       //< Code to first line number.
+  int           strData;        //< Compact ASCII string to characters.
+};
+
+static const PyLayout           s_layouts[] = {
+  { 0x0308, 24, -1, 32, 24, -1, -1, 104, 112, 40, 48 },
+  { 0x0309, 24, -1, 32, 24, -1, -1, 104, 112, 40, 48 },
+  { 0x030a, 24, -1, 32, 24, -1, -1, 104, 112, 40, 48 },
+  { 0x030b, 56,  8, 32, 48, 68, 69, 112, 128, 72, 48 },
+  { 0x030c, 56,  0,  0,  8, -1, 70, 112, 128, 68, 40 },
+  { 0x030d, 72, -1,  0,  8, -1, 70, 112, 128, 68, 40 }
+};
+
+static const int                OWNED_BY_CSTACK = 3;
+static const int                MAX_NAME        = 256;
+static bool                     s_initialized   = false;
+static const PyLayout           *s_layout       = 0;
+static void                     *s_codetype     = 0;
+static void                     *s_strtype      = 0;
+static int                      (*s_pyinitialized)(void) = 0;
+static void                     *(*s_threadstate)(void) = 0;
+static char                     s_endframe;
+
+/** Read the pointer at byte offset @a offset of @a p. */
+static inline char *
+field(const char *p, int offset)
+{
+  return *(char * const *) (p + offset);
+}
+
+/** Get the characters of the compact ASCII string object @a str into
+    @a data and @a len.  Returns false for anything else.  */
+static bool
+asciiString(const char *str, const char *&data, size_t &len)
+{
+  if (! str || field(str, 8) != s_strtype)
+    return false;
+
+  // The compact and ascii bits of the string state.
+  uint32_t state = *(const uint32_t *) (str + 32);
+  if ((state & 0x60) != 0x60)
+    return false;
+
+  len = *(const size_t *) (str + 16);
+  data = str + s_layout->strData;
+  return len < MAX_NAME;
+}
+
+/** Return the synthetic frame "py:MODULE.FUNCTION:LINE" for the code
+    object @a code, where MODULE is the base name of the source file and
+    LINE the first line of the function, or null if the code object
+    does not look valid.  */
+static void *
+pythonFrame(const char *code)
+{
+  const char    *name, *file;
+  size_t        namelen, filelen;
+  char          buf[3*MAX_NAME];
+  size_t        len = 0;
+
+  if (! code || field(code, 8) != s_codetype
+      || ! asciiString(field(code, s_layout->codeName), name, namelen))
+    return 0;
+
+  memcpy(buf, "py:", 3);
+  len = 3;
+  if (asciiString(field(code, s_layout->codeFilename), file, filelen))
+  {
+    // Use the directory name for package "__init__.py" files.
+    size_t start = filelen, end = filelen;
+    if (end > 3 && ! memcmp(file + end - 3, ".py", 3))
+      end -= 3;
+    while (start > 0 && file[start-1] != '/')
+      --start;
+    if (end - start == 8 && ! memcmp(file + start, "__init__", 8) && start > 1)
+    {
+      end = start - 1;
+      for (start = end; start > 0 && file[start-1] != '/'; --start)
+        ;
+    }
+    memcpy(buf + len, file + start, end - start);
+    len += end - start;
+    buf[len++] = '.';
+  }
+
+  memcpy(buf + len, name, namelen);
+  len += namelen;
+  buf[len++] = ':';
+
+  char digits[16];
+  int ndigits = 0;
+  unsigned line = *(const int *) (code + s_layout->codeLine);
+  do
+    digits[ndigits++] = '0' + line % 10;
+  while ((line /= 10) && ndigits < 16);
+  while (ndigits)
+    buf[len++] = digits[--ndigits];
+
+  return igprof_synthetic_frame_signal(buf, len);
+}
+
+/** Unwinder for CPython evaluation loop frames.  Before 3.11 each loop
+    frame runs one Python frame.  Since then a loop frame runs Python
+    frames up to the one entered from C, which 3.11 flags, and 3.12
+    and later mark with a shim frame owned by the C stack.  */
+static int
+unwindPython(void **state, void **frames, int maxframes)
+{
+  const PyLayout &l = *s_layout;
+  char *frame = (char *) *state;
+  int n = 0;
+
+  if (frame == &s_endframe)
+    return 0;
+
+  if (! frame)
+  {
+    // The thread state is only valid once the interpreter is up.
+    char *tstate = s_pyinitialized() ? (char *) s_threadstate() : 0;
+    if (tstate && (frame = field(tstate, l.tstateFrame)) && l.cframeFrame >= 0)
+      frame = field(frame, l.cframeFrame);
+  }
+
+  while (frame && n < maxframes)
+  {
+    if (l.frameEntry < 0 && l.frameOwner >= 0
+        && frame[l.frameOwner] == OWNED_BY_CSTACK)
+    {
+      frame = field(frame, l.frameBack);
+      break;
+    }
+
+    if (void *f = pythonFrame(field(frame, l.frameCode)))
+      frames[n++] = f;
+
+    bool entry = l.frameEntry >= 0 && frame[l.frameEntry];
+    frame = field(frame, l.frameBack);
+    if (l.version < 0x030b || entry)
+      break;
+  }
+
+  *state = frame ? frame : &s_endframe;
+  return n;
+}
+
+// -------------------------------------------------------------------
+/** Possibly start replacing CPython evaluation loop frames with the
+    Python functions they run.  */
+static void
+initialize(void)
+{
+  if (s_initialized) return;
+  s_initialized = true;
+
+  const char    *options = igprof_options();
+  bool          enable = false;
+
+  while (options && *options)
+  {
+    while (*options == ' ' || *options == ',')
+      ++options;
+
+    if (! strncmp(options, "python", 6))
+    {
+      enable = true;
+      options += 6;
+    }
+    else
+      options++;
+
+    while (*options && *options != ',' && *options != ' ')
+      options++;
+  }
+
+  if (! enable)
+    return;
+
+#if __linux && __LP64__
+  // The interpreter has to be linked into the program, not loaded later.
+  void *eval = dlsym(RTLD_DEFAULT, "_PyEval_EvalFrameDefault");
+  const char *(*version)(void) = (const char *(*)(void)) dlsym(RTLD_DEFAULT, "Py_GetVersion");
+  s_pyinitialized = (int (*)(void)) dlsym(RTLD_DEFAULT, "Py_IsInitialized");
+  s_threadstate = (void *(*)(void)) dlsym(RTLD_DEFAULT, "PyGILState_GetThisThreadState");
+  s_codetype = dlsym(RTLD_DEFAULT, "PyCode_Type");
+  s_strtype = dlsym(RTLD_DEFAULT, "PyUnicode_Type");
+  if (! eval || ! version || ! s_pyinitialized || ! s_threadstate
+      || ! s_codetype || ! s_strtype)
+  {
+    igprof_debug("python frames: no python interpreter in this program\n");
+    return;
+  }
+
+  char *end = 0;
+  const char *v = version();
+  int major = strtol(v, &end, 10);
+  int minor = (*end == '.' ? strtol(end+1, 0, 10) : -1);
+  for (size_t i = 0; i < sizeof(s_layouts)/sizeof(s_layouts[0]); ++i)
+    if (s_layouts[i].version == ((major << 8) | minor))
+      s_layout = &s_layouts[i];
+
+  if (! s_layout)
+    igprof_debug("python frames: python %d.%d is not supported\n", major, minor);
+  else if (! IgHookTrace::addUnwinder(eval, &unwindPython))
+    igprof_debug("python frames: cannot find the python evaluation loop\n");
+  else
+    igprof_debug("python frames: showing python %d.%d functions\n", major, minor);
+#else
+  igprof_debug("python frames: not supported on this platform\n");
+#endif
+}
+
+// -------------------------------------------------------------------
+static bool autoboot __attribute__((used)) = (initialize(), true);
@@ -0,0 +1,282 @@
+#include "profile.h"
+#include "profile-trace.h"
+#include "hook.h"
+#include "walk-syms.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if __linux
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+// -------------------------------------------------------------------
+// Traps for this profiler module
+LIBHOOK(0, int, dofork, _main, (), (), "fork", 0, 0)
+
+// Data for this profiler module
+static IgProfTrace::CounterDef  s_ct_pgfault    = { "PGFAULT", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_csw        = { "CSW", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_migr       = { "MIGR", IgProfTrace::TICK, -1, 0 };
+static bool                     s_initialized   = false;
+static int                      s_signal        = 0;
+static pthread_key_t            s_eventkey;
+
+/** A kernel software event sampled by this profiler. */
+struct HIDDEN SwEvent
+{
+  const char                    *option;
+  int                           config;
+  IgProfTrace::CounterDef       *def;
+  long                          period;
+};
+
+static const int                NUM_EVENTS      = 3;
+#if __linux
+static SwEvent                  s_events[NUM_EVENTS] = {
+  { "pgfault", PERF_COUNT_SW_PAGE_FAULTS,       &s_ct_pgfault,  0 },
+  { "csw",     PERF_COUNT_SW_CONTEXT_SWITCHES,  &s_ct_csw,      0 },
+  { "migr",    PERF_COUNT_SW_CPU_MIGRATIONS,    &s_ct_migr,     0 }
+};
+static const long               s_defperiod[NUM_EVENTS] = { 64, 16, 1 };
+#endif
+
+/** The perf event file descriptors of a thread, -1 if not open. */
+struct HIDDEN SwEventThread
+{
+  int                           fd[NUM_EVENTS];
+};
+
+#if __linux
+/** Open the perf event @a ev for the calling thread and have its
+    overflows signalled to this thread.  Counts events in the kernel
+    too if allowed, otherwise only in user space, which misses all
+    context switches and migrations.  Returns the file descriptor, or
+    -1 on failure.  */
+static int
+openEvent(SwEvent &ev)
+{
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = ev.config;
+  attr.sample_period = ev.period;
+  attr.disabled = 1;
+
+  int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM))
+  {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  if (fd < 0)
+    return -1;
+
+  f_owner_ex owner = { F_OWNER_TID, (pid_t) syscall(SYS_gettid) };
+  if (fcntl(fd, F_SETFL, O_ASYNC) < 0
+      || fcntl(fd, F_SETSIG, s_signal) < 0
+      || fcntl(fd, F_SETOWN_EX, &owner) < 0
+      || ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+#endif
+
+/** Close the perf events of an exiting thread. */
+static void
+closeEvents(void *arg)
+{
+  SwEventThread *t = (SwEventThread *) arg;
+  for (int i = 0; i < NUM_EVENTS; ++i)
+    if (t->fd[i] >= 0)
+      close(t->fd[i]);
+  delete t;
+}
+
+/** Open the enabled perf events for the calling thread.  */
+static void
+threadInit(void)
+{
+#if __linux
+  SwEventThread *t = new SwEventThread;
+  for (int i = 0; i < NUM_EVENTS; ++i)
+  {
+    t->fd[i] = -1;
+    if (s_events[i].period && (t->fd[i] = openEvent(s_events[i])) < 0)
+      igprof_debug("software event profiler: cannot open %s event: %s\n",
+                   s_events[i].option, strerror(errno));
+  }
+  pthread_setspecific(s_eventkey, t);
+#endif
+}
+
+/** Software event overflow signal handler.  Identify the event from
+    the file descriptor the kernel passes with the signal, and record
+    one sampling period worth of events for the current program
+    location.  Skip the sample when this profiler is not enabled.  */
+static void
+eventSignalHandler(int /* nsig */, siginfo_t *info, void * /* ctx */)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  if (LIKELY(igprof_disable()))
+  {
+    IgProfTrace *buf = igprof_buffer();
+    SwEventThread *t = (SwEventThread *) pthread_getspecific(s_eventkey);
+    if (LIKELY(buf && t && info))
+    {
+#if __linux
+      for (int i = 0; i < NUM_EVENTS; ++i)
+        if (t->fd[i] >= 0 && t->fd[i] == info->si_fd)
+        {
+          IgProfTrace::Stack *frame;
+          uint64_t tstart, tend;
+          int depth;
+
+          RDTSC(tstart);
+          depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+          RDTSC(tend);
+
+          // Drop top two stackframes (me, signal frame).
+          buf->lock();
+          frame = buf->push(addresses+2, depth-2);
+          buf->tick(frame, s_events[i].def, s_events[i].period, 1);
+          buf->traceperf(depth, tstart, tend);
+          buf->unlock();
+          break;
+        }
+#endif
+    }
+  }
+  igprof_enable();
+}
+
+// -------------------------------------------------------------------
+/** Possibly start software event profiler.  */
+static void
+initialize(void)
+{
+  if (s_initialized) return;
+  s_initialized = true;
+
+  const char    *options = igprof_options();
+  bool          enable = false;
+#if __linux
+  bool          any = false;
+#endif
+
+  while (options && *options)
+  {
+    while (*options == ' ' || *options == ',')
+      ++options;
+
+    if (! strncmp(options, "swevent", 7))
+    {
+      enable = true;
+      options += 7;
+      while (*options == ':')
+      {
+#if __linux
+        int i;
+        for (i = 0; i < NUM_EVENTS; ++i)
+        {
+          size_t len = strlen(s_events[i].option);
+          if (! strncmp(options+1, s_events[i].option, len))
+          {
+            options += len + 1;
+            s_events[i].period = s_defperiod[i];
+            if (*options == '=')
+            {
+              long period = strtol(options+1, const_cast<char **>(&options), 10);
+              if (period > 0)
+                s_events[i].period = period;
+            }
+            any = true;
+            break;
+          }
+        }
+        if (i == NUM_EVENTS)
+#endif
+          break;
+      }
+    }
+    else
+      options++;
+
+    while (*options && *options != ',' && *options != ' ')
+      options++;
+  }
+
+  if (! enable)
+    return;
+
+#if __linux
+  // Sample all the events if none was chosen.
+  for (int i = 0; i < NUM_EVENTS && ! any; ++i)
+    s_events[i].period = s_defperiod[i];
+
+  if (! igprof_init("software event profiler", &threadInit, true))
+    return;
+
+  igprof_disable_globally();
+  s_signal = SIGRTMIN + 5;
+  for (int i = 0; i < NUM_EVENTS; ++i)
+    if (s_events[i].period)
+      igprof_debug("software event profiler: sampling every %ld %s events"
+                   " as %s\n", s_events[i].period, s_events[i].option,
+                   s_events[i].def->name);
+
+  struct sigaction sa;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_sigaction = &eventSignalHandler;
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigaction(s_signal, &sa, 0);
+
+  pthread_key_create(&s_eventkey, &closeEvents);
+  threadInit();
+
+  IgHook::hook(dofork_hook_main.raw);
+  igprof_debug("software event profiler enabled on signal %d\n", s_signal);
+  igprof_enable_globally();
+#else
+  igprof_debug("software event profiler: not supported on this platform\n");
+#endif
+}
+
+// -------------------------------------------------------------------
+// Trap fork() to open new events in the child.  The events inherited
+// from the parent would keep measuring the parent's thread.
+static int
+dofork(IgHook::SafeData<igprof_dofork_t> &hook)
+{
+  igprof_disable();
+  int ret = hook.chain();
+  if (ret == 0)
+  {
+    SwEventThread *t = (SwEventThread *) pthread_getspecific(s_eventkey);
+    if (t)
+    {
+      pthread_setspecific(s_eventkey, 0);
+      closeEvents(t);
+    }
+    threadInit();
+  }
+
+  igprof_enable();
+  return ret;
+}
+
+// -------------------------------------------------------------------
+static bool autoboot __attribute__((used)) = (initialize(), true);
@@ -1,6 +1,7 @@
 #include "profile-trace.h"
 #include "walk-syms.h"
 #include <stdio.h>
+#include <string.h>
 
 #if DEBUG
 IgProfTrace::Counter IgProfTrace::FREED;
@@ -40,6 +41,7 @@ IgProfTrace::IgProfTrace(void)
   perfStats_.sum2Ticks = 0;
   perfStats_.sumTPerD  = 0;
   perfStats_.sum2TPerD = 0;
+  perfStats_.ndropped  = 0;
 }
 
 IgProfTrace::~IgProfTrace(void)
@@ -69,6 +71,47 @@ IgProfTrace::reset(void)
   perfStats_.sum2Ticks = 0;
   perfStats_.sumTPerD  = 0;
   perfStats_.sum2TPerD = 0;
+  perfStats_.ndropped  = 0;
+}
+
+/** Locate the live resources containing @a n addresses.
+
+    Unlike findResource(), which only finds a resource by its exact
+    identity, this treats each resource as the address range of its
+    size and finds the one each of @a addresses falls in.  The hash
+    cannot answer range queries, so this scans the whole table once;
+    pass as many addresses in one call as possible.  The addresses must
+    be sorted in increasing order.  On return @a found[i] is the hash
+    slot of the resource containing @a addresses[i], or null if none
+    does.  */
+void
+IgProfTrace::findResources(const Address *addresses, int n, HResource **found)
+{
+  memset(found, 0, n * sizeof(*found));
+  if (n <= 0)
+    return;
+
+  Address first = addresses[0];
+  for (HResource *hr = restable_, *end = hr + (1u << hashLogSize_); hr < end; ++hr)
+  {
+    if (! hr->record || hr->resource + hr->record->size <= first)
+      continue;
+
+    // Binary search for the first address at or above the resource.
+    int lo = 0, hi = n;
+    while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (addresses[mid] < hr->resource)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    for ( ; lo < n && addresses[lo] - hr->resource < hr->record->size; ++lo)
+      if (! found[lo])
+        found[lo] = hr;
+  }
 }
 
 void
@@ -153,8 +196,8 @@ IgProfTrace::mergeFrom(int depth, Stack *frame, void **callstack)
     else if (c->ticks)
       for (Resource *r = c->resources; r; r = r->nextlive)
       {
-        Counter *ctr = tick(myframe, c->def, r->size, 1);
-	acquire(ctr, r->hashslot->resource, r->size);
+        if (Counter *ctr = tick(myframe, c->def, r->size, 1))
+	  acquire(ctr, r->hashslot->resource, r->size, r->stamp, r->thread);
       }
 
     // Adjust the peak counter if necessary.
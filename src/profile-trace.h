@@ -76,7 +76,7 @@ public:
   static const int MAX_DEPTH = 800;
 
   /// Maximum number of counters supported per stack frace.
-  static const int MAX_COUNTERS = 3;
+  static const int MAX_COUNTERS = 8;
 
   /// Maximum number of hashs probe steps to look for a resource.
   static const size_t MAX_HASH_PROBES = 32;
@@ -84,6 +84,15 @@ public:
   /// A value that might be an address, usually memory resource.
   typedef uintptr_t Address;
 
+  /// Resource address bits from which callers may tag resources to
+  /// tell apart several at the same address.  Not shown in leaks.
+  /// Zero if addresses have no spare bits, as on 32-bit systems.
+  static const int RESOURCE_TAG_SHIFT = sizeof(Address) == 8 ? 58 : 0;
+
+  /// Mask to remove the tag from a resource address.
+  static const Address RESOURCE_ADDRESS_MASK
+    = RESOURCE_TAG_SHIFT ? ((Address) 1 << RESOURCE_TAG_SHIFT) - 1 : ~(Address) 0;
+
   /// A large-sized accumulated value for counters.
   typedef uintmax_t Value;
 
@@ -97,6 +106,7 @@ public:
     uint64_t    sum2Ticks;      //< sum(ticks_for_trace^2).
     uint64_t    sumTPerD;       //< sum((ticks << 4) / depth).
     uint64_t    sum2TPerD;      //< sum(((ticks << 4) / depth)^2).
+    uint64_t    ndropped;       //< Ticks dropped for want of a counter slot.
 
     PerfStat &operator+=(const PerfStat &other);
   };
@@ -189,6 +199,8 @@ public:
     Resource    *nextlive;      //< Next live resource in the same counter.
     Counter     *counter;       //< Counter tracking this resource.
     Value       size;           //< Size of the resource.
+    uint64_t    stamp;          //< Acquisition time, if the caller keeps one.
+    uint32_t    thread;         //< Acquiring thread, if the caller keeps one.
   };
 
   IgProfTrace(void);
@@ -197,10 +209,14 @@ public:
   void			reset(void);
   void                  lock(void);
   Stack *               push(void **stack, int depth);
+  Stack *               child(Stack *parent, void *address);
   Counter *             tick(Stack *frame, CounterDef *def, Value amount, Value ticks);
-  void                  acquire(Counter *ctr, Address resource, Value size);
+  void                  acquire(Counter *ctr, Address resource, Value size,
+                                uint64_t stamp = 0, uint32_t thread = 0);
   void                  release(Address resource);
   HResource *           findResource(Address resource);
+  void                  findResources(const Address *addresses, int n,
+                                      HResource **found);
   void                  traceperf(int depth, uint64_t tstart, uint64_t tend);
   void                  mergeFrom(IgProfTrace &other);
   void                  unlock(void);
@@ -257,6 +273,7 @@ IgProfTrace::PerfStat::operator+=(const PerfStat &other)
   sum2Ticks += other.sum2Ticks;
   sumTPerD  += other.sumTPerD;
   sum2TPerD += other.sum2TPerD;
+  ndropped  += other.ndropped;
   return *this;
 }
 
@@ -413,8 +430,8 @@ IgProfTrace::releaseResource(HResource *hres)
     address, and return pointer to the stack node. Creates the stack
     frame object in appropriate location if necessary.
 
-    This code deliberately does things the "slow" way. It has only one
-    caller, which already does caching of recently seen stack frames.
+    This code deliberately does things the "slow" way. Its main
+    caller already does caching of recently seen stack frames.
     Be careful about trying to optimise things here - there is a fair
     chance of simply making things slower by adding complexity. */
 inline IgProfTrace::Stack *
@@ -487,7 +504,9 @@ IgProfTrace::push(void **stack, int depth)
 
 /** Tick a counter @a def in stack @a frame by @a amount and @a ticks.
     Returns the pointer to the counter object in case the caller wants
-    to also call acquire(). */
+    to also call acquire(), or null if the frame already has a full set
+    of MAX_COUNTERS other counters, in which case the tick is dropped
+    and only counted in the performance statistics. */
 inline IgProfTrace::Counter *
 IgProfTrace::tick(Stack *frame, CounterDef *def, Value amount, Value ticks)
 {
@@ -519,7 +538,11 @@ IgProfTrace::tick(Stack *frame, CounterDef *def, Value amount, Value ticks)
     }
   }
 
-  ASSERT(c);
+  if (UNLIKELY(! c))
+  {
+    ++perfStats_.ndropped;
+    return 0;
+  }
 
   // Tick the counter.
   if (def->type == TICK)
@@ -537,9 +560,12 @@ IgProfTrace::tick(Stack *frame, CounterDef *def, Value amount, Value ticks)
   return c;
 }
 
-/** Attach resource @a resource of @a size amount to counter @a ctr. */
+/** Attach resource @a resource of @a size amount to counter @a ctr.
+    The caller may remember when it was acquired in @a stamp, and by
+    which thread in @a thread. */
 inline void
-IgProfTrace::acquire(Counter *ctr, Address resource, Value size)
+IgProfTrace::acquire(Counter *ctr, Address resource, Value size,
+                     uint64_t stamp, uint32_t thread)
 {
   ASSERT(ctr);
 
@@ -594,12 +620,20 @@ IgProfTrace::acquire(Counter *ctr, Address resource, Value size)
   res->nextlive = ctr->resources;
   res->counter = ctr;
   res->size = size;
+  res->stamp = stamp;
+  res->thread = thread;
   ctr->resources = res;
   if (res->nextlive)
     res->nextlive->prevlive = res;
   ++hashUsed_;
 }
 
+/** Return the stack frame for a call to @a address from @a parent,
+    for callers which attach synthetic frames under a recorded stack. */
+inline IgProfTrace::Stack *
+IgProfTrace::child(Stack *parent, void *address)
+{ return childStackNode(parent, address); }
+
 /** Release @a resource from which ever counter owns it. */
 inline void
 IgProfTrace::release(Address resource)
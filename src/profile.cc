@@ -110,6 +110,7 @@ LIBHOOK(4, int, dopthread_create, _pthread21,
 
 // Data for this profiler module
 static const int        MAX_FNAME       = 1024;
+static const int        MAX_SYNTHETIC   = 4096;
 static const char       *s_initialized  = 0;
 static bool             s_perthread     = false;
 static volatile int     s_quitting      = 0;
@@ -118,12 +119,23 @@ static pthread_mutex_t  s_buflock       = PTHREAD_MUTEX_INITIALIZER;
 static IgProfTrace      *s_masterbuf    = 0;
 static IgProfTrace      *s_tracebuf     = 0;
 static void             (*s_threadinit)() = 0;
+static void             (*s_flush)() = 0;
 static const char       *s_options      = 0;
 static char             s_masterbufdata[sizeof(IgProfTrace)];
 static pthread_t        s_mainthread;
 static pthread_t        s_dumpthread;
 static char             s_outname[MAX_FNAME];
 static char             s_dumpflag[MAX_FNAME];
+static pthread_mutex_t  s_synthlock     = PTHREAD_MUTEX_INITIALIZER;
+static char             s_synthetic[MAX_SYNTHETIC];
+static const char       *s_synthnames[MAX_SYNTHETIC];
+static int              s_nsynthetic    = 0;
+static const int        MAX_SIGSYNTH    = 1 << 16;
+static const size_t     SIGSYNTH_POOL   = 4*1024*1024;
+static char             s_sigsynthetic[MAX_SIGSYNTH];
+static const char       *s_sigsynthnames[MAX_SIGSYNTH];
+static char             s_sigsynthpool[SIGSYNTH_POOL];
+static size_t           s_sigsynthused  = 0;
 
 /** Return set of currently outstanding profile buffers. */
 static std::set<IgProfTrace *> &
@@ -231,6 +243,7 @@ dumpOneProfile(IgProfDumpInfo &info, IgProfTrace::Stack *frame)
       }
     }
 
+    const IgProfTrace::Address untag = IgProfTrace::RESOURCE_ADDRESS_MASK;
     IgProfTrace::Counter **ctr = &frame->counters[0];
     for (int i = 0; i < IgProfTrace::MAX_COUNTERS && *ctr; ++i, ++ctr)
     {
@@ -258,7 +271,7 @@ dumpOneProfile(IgProfDumpInfo &info, IgProfTrace::Stack *frame)
             IgProfTrace::Value derived_size;
             derived_size = c->def->derivedLeakSize(res->hashslot->resource, res->size);
             if (derived_size)
-              info.io.put(";LK=(").put((void *) res->hashslot->resource)
+              info.io.put(";LK=(").put((void *) (res->hashslot->resource & untag))
                      .put(",").put(derived_size)
                      .put(")");
           }
@@ -266,7 +279,7 @@ dumpOneProfile(IgProfDumpInfo &info, IgProfTrace::Stack *frame)
         else
         {  // Resource size is the leak size
           for (IgProfTrace::Resource *res = c->resources; res; res = res->nextlive)
-            info.io.put(";LK=(").put((void *) res->hashslot->resource)
+            info.io.put(";LK=(").put((void *) (res->hashslot->resource & untag))
             .put(",").put(res->size)
             .put(")");
         }
@@ -319,6 +332,10 @@ dumpAllProfiles(void *arg)
     pthread_sigmask(SIG_BLOCK, &everything, &sigmask);
   }
 
+  // Let the profiler move any pending data into the buffers.
+  if (s_flush)
+    (*s_flush)();
+
   char outname[MAX_FNAME];
   const char *tofile = info->tofile;
   if (! tofile || ! tofile[0])
@@ -398,11 +415,13 @@ dumpAllProfiles(void *arg)
   igprof_debug("trace perf: ntraces=%.0f"
 	       " depth=[av %.1f, rms %.1f]"
 	       " ticks=[av %.1f, rms %.1f]"
-	       " ticks-per-depth=[av %.1f, rms %.1f]\n",
+	       " ticks-per-depth=[av %.1f, rms %.1f]"
+	       " dropped=%.0f\n",
                1. * perf.ntraces,
 	       depthAvg, sqrt((1. * perf.sum2Depth) / perf.ntraces - depthAvg * depthAvg),
 	       ticksAvg, sqrt((1. * perf.sum2Ticks) / perf.ntraces - ticksAvg * ticksAvg),
-	       tperdAvg, sqrt((1./16/16 * perf.sum2TPerD) / perf.ntraces - tperdAvg * tperdAvg));
+	       tperdAvg, sqrt((1./16/16 * perf.sum2TPerD) / perf.ntraces - tperdAvg * tperdAvg),
+	       1. * perf.ndropped);
   setlocale(LC_ALL, old_locale);
   return 0;
 }
@@ -429,7 +448,7 @@ asyncDumpThread(void *)
     {
       unlink(s_dumpflag);
       IgProfDumpInfo info = { 0, 0, 0, 0, s_outname, 0, -1, 0, 1,
-                              { 0, 0, 0, 0, 0, 0, 0 } };
+                              { 0, 0, 0, 0, 0, 0, 0, 0 } };
       dumpAllProfiles(&info);
       dodump = 0;
     }
@@ -446,7 +465,7 @@ igprof_dump_now(const char *tofile)
 {
   pthread_t tid;
   IgProfDumpInfo info = { 0, 0, 0, 0, tofile, 0, -1, 0, 1,
-                          { 0, 0, 0, 0, 0, 0, 0 } };
+                          { 0, 0, 0, 0, 0, 0, 0, 0 } };
   pthread_create(&tid, 0, &dumpAllProfiles, &info);
   pthread_join(tid, 0);
 }
@@ -471,7 +490,7 @@ exitDump(void *)
 
   // Dump all buffers.
   IgProfDumpInfo info = { 0, 0, 0, 0, s_outname, 0, -1, 0, 0,
-                          { 0, 0, 0, 0, 0, 0, 0 } };
+                          { 0, 0, 0, 0, 0, 0, 0, 0 } };
   dumpAllProfiles(&info);
   igprof_debug("igprof quitting\n");
   s_initialized = 0; // signal local data is unsafe to use
@@ -484,9 +503,14 @@ exitDump(void *)
     to run on library load.  All profiler modules should invoke
     this method before doing their own initialisation.
 
+    If @a flush is given, it is called before each profile dump to
+    let the profiler move data it has not yet recorded into the
+    profile buffers.
+
     Returns @c true if profiling is activated in this process.  */
 bool
-igprof_init(const char *id, void (*threadinit)(void), bool perthread, double clockres)
+igprof_init(const char *id, void (*threadinit)(void), bool perthread,
+            double clockres, void (*flush)(void))
 {
   // Refuse to initialise more than once.
   if (s_initialized)
@@ -572,6 +596,7 @@ igprof_init(const char *id, void (*threadinit)(void), bool perthread, double clo
   s_masterbuf = new (s_masterbufdata) IgProfTrace;
   s_perthread = perthread;
   s_threadinit = threadinit;
+  s_flush = flush;
   s_mainthread = pthread_self();
   s_tracebuf = makeTraceBuffer();
 
@@ -712,6 +737,14 @@ igprof_options(void)
   return s_options;
 }
 
+/** Get the profile output name given with "igprof:out", or an empty
+    string if none was given.  */
+const char *
+igprof_outname(void)
+{
+  return s_outname;
+}
+
 /** Reset all current profile buffers. */
 void
 igprof_reset_profiles(void)
@@ -733,6 +766,83 @@ igprof_reset_profiles(void)
   pthread_mutex_unlock(&s_buflock);
 }
 
+/** Return a synthetic stack frame address for @a name.  Profilers
+    can insert the address into stack traces to attribute costs to
+    something which is not a function, such as a marked code region.
+    The address is unique for each distinct name and is reported with
+    @a name as the symbol name in the profile dump.  Returns null if
+    there are too many synthetic frames.  Must not be called from a
+    signal handler.  */
+void *
+igprof_synthetic_frame(const char *name)
+{
+  void *frame = 0;
+  pthread_mutex_lock(&s_synthlock);
+  for (int i = 0; i < s_nsynthetic && ! frame; ++i)
+    if (! strcmp(s_synthnames[i], name))
+      frame = &s_synthetic[i];
+
+  if (! frame && s_nsynthetic < MAX_SYNTHETIC)
+  {
+    s_synthnames[s_nsynthetic] = strdup(name);
+    frame = &s_synthetic[s_nsynthetic++];
+  }
+  pthread_mutex_unlock(&s_synthlock);
+  return frame;
+}
+
+/** Return a synthetic stack frame address for the @a len characters
+    of @a name, like #igprof_synthetic_frame(), but without locks or
+    memory allocation so that it can be called from a signal handler.
+    Meant for names only known while sampling, such as the functions
+    of interpreted code.  The names live in a separate fixed size hash
+    table; returns null when it is full.  */
+void *
+igprof_synthetic_frame_signal(const char *name, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i)
+    hash = (hash ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+
+  for (int probe = 0; probe < MAX_SIGSYNTH; ++probe)
+  {
+    int slot = (hash + probe) & (MAX_SIGSYNTH-1);
+    const char *cur = __atomic_load_n(&s_sigsynthnames[slot], __ATOMIC_ACQUIRE);
+    if (! cur)
+    {
+      size_t off = __atomic_fetch_add(&s_sigsynthused, len+1, __ATOMIC_RELAXED);
+      if (off + len + 1 > SIGSYNTH_POOL)
+        return 0;
+
+      // Another thread may claim the slot first, maybe for this name.
+      char *copy = s_sigsynthpool + off;
+      memcpy(copy, name, len);
+      copy[len] = 0;
+      if (__atomic_compare_exchange_n(&s_sigsynthnames[slot], &cur, copy, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return &s_sigsynthetic[slot];
+    }
+
+    if (! strncmp(cur, name, len) && ! cur[len])
+      return &s_sigsynthetic[slot];
+  }
+
+  return 0;
+}
+
+/** Return the name of a synthetic stack frame @a address obtained
+    from #igprof_synthetic_frame() or #igprof_synthetic_frame_signal(),
+    or null if it is an ordinary code address.  */
+const char *
+igprof_synthetic_name(void *address)
+{
+  char *p = (char *) address;
+  if (p >= s_sigsynthetic && p < s_sigsynthetic + MAX_SIGSYNTH)
+    return __atomic_load_n(&s_sigsynthnames[p - s_sigsynthetic], __ATOMIC_ACQUIRE);
+  return (p >= s_synthetic && p < s_synthetic + s_nsynthetic)
+    ? s_synthnames[p - s_synthetic] : 0;
+}
+
 /** Internal assertion helper routine.  */
 int
 igprof_panic(const char *file, int line, const char *func, const char *expr)
@@ -909,7 +1019,7 @@ dokill(IgHook::SafeData<igprof_dokill_t> &hook, pid_t pid, int sig)
       igprof_disable_globally();
       igprof_debug("kill(%d,%d) called, dumping state\n", (int) pid, sig);
       IgProfDumpInfo info = { 0, 0, 0, 0, s_outname, 0, -1, 0, 0,
-                              { 0, 0, 0, 0, 0, 0, 0 } };
+                              { 0, 0, 0, 0, 0, 0, 0, 0 } };
       dumpAllProfiles(&info);
       igprof_enable_globally();
     }
@@ -26,11 +26,16 @@ extern char *           (*igprof_getenv) (const char *);
 extern int              (*igprof_unsetenv) (const char *);
 
 HIDDEN const char *igprof_options(void);
+HIDDEN const char *igprof_outname(void);
 HIDDEN void igprof_reset_profiles(void);
+HIDDEN void *igprof_synthetic_frame(const char *name);
+HIDDEN void *igprof_synthetic_frame_signal(const char *name, size_t len);
+HIDDEN const char *igprof_synthetic_name(void *address);
 HIDDEN void igprof_debug(const char *format, ...);
 HIDDEN int igprof_panic(const char *file, int line, const char *func, const char *expr);
 HIDDEN bool igprof_init(const char *id, void (*threadinit)(void),
-	                bool perthread, double clockres = 0.);
+	                bool perthread, double clockres = 0.,
+	                void (*flush)(void) = 0);
 
 /** Return a profile buffer for a profiler in the current thread.  It
     is safe to call this function from any thread and in asynchronous
@@ -1,6 +1,109 @@
 #include "sym-cache.h"
 #include "walk-syms.h"
+#include <algorithm>
 #include <memory.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Order JIT symbols by start address, then by load order.  */
+static bool
+jitSymbolBefore(const IgProfSymCache::JitSymbol *a,
+                const IgProfSymCache::JitSymbol *b)
+{
+  return a->start < b->start
+    || (a->start == b->start && a->order < b->order);
+}
+
+/** Parse a hexadecimal number, with optional "0x" prefix, at @a p and
+    advance @a p past it.  Stops at @a end.  */
+static uint64_t
+parseHex(const char *&p, const char *end)
+{
+  uint64_t value = 0;
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    p += 2;
+  for (; p < end; ++p)
+    if (*p >= '0' && *p <= '9')
+      value = value * 16 + (*p - '0');
+    else if (*p >= 'a' && *p <= 'f')
+      value = value * 16 + (*p - 'a' + 10);
+    else if (*p >= 'A' && *p <= 'F')
+      value = value * 16 + (*p - 'A' + 10);
+    else
+      break;
+  return value;
+}
+
+/** Map the file @a path into memory for reading.  Returns the data and
+    sets @a size to its length, or returns null if the file cannot be
+    read or is empty.  */
+static const char *
+mapFile(const char *path, size_t &size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+
+  size = st.st_size;
+  return (const char *) data;
+}
+
+/** Find the jitdump file of this process.  A JIT writing one maps it
+    into memory so that perf can find it, so look for it among the
+    mappings of this process.  Fills @a path and returns true if found. */
+static bool
+findJitDump(char *path, size_t maxpath)
+{
+  char suffix[64];
+  size_t suffixlen = snprintf(suffix, sizeof(suffix), "/jit-%ld.dump", (long) getpid());
+  int fd = open("/proc/self/maps", O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  char buf[4096];
+  size_t len = 0;
+  bool found = false;
+  ssize_t n;
+  while (! found && (n = read(fd, buf + len, sizeof(buf) - len)) > 0)
+  {
+    len += n;
+    char *line = buf, *eol;
+    while (! found && (eol = (char *) memchr(line, '\n', buf + len - line)))
+    {
+      // The path starts at the first '/' on the line.
+      char *name = (char *) memchr(line, '/', eol - line);
+      size_t namelen = name ? eol - name : 0;
+      if (namelen >= suffixlen && namelen < maxpath
+          && ! memcmp(eol - suffixlen, suffix, suffixlen))
+      {
+        memcpy(path, name, namelen);
+        path[namelen] = 0;
+        found = true;
+      }
+      line = eol + 1;
+    }
+
+    // Keep the partial last line, drop overly long ones.
+    len = buf + len - line;
+    if (len == sizeof(buf))
+      len = 0;
+    memmove(buf, line, len);
+  }
+
+  close(fd);
+  return found;
+}
 
 /** Initialise a symbol translation buffer.  */
 IgProfSymCache::IgProfSymCache(void)
@@ -8,11 +111,18 @@ IgProfSymCache::IgProfSymCache(void)
   memset(bintable_, 0, sizeof(bintable_));
   memset(symtable_, 0, sizeof(symtable_));
   memset(symcache_, 0, sizeof(symcache_));
+  jitlist_ = 0;
+  jitsyms_ = 0;
+  njitsyms_ = 0;
+  jitloaded_ = false;
 }
 
 /** Destroy the symbol translation buffer.  */
 IgProfSymCache::~IgProfSymCache(void)
-{}
+{
+  if (jitsyms_)
+    unallocateRaw(jitsyms_, njitsyms_ * sizeof(JitSymbol *));
+}
 
 /** Get the symbol for an address if there is one.  */
 IgProfSymCache::Symbol *
@@ -53,7 +163,17 @@ IgProfSymCache::roundAddressToSymbol(void *address)
   Symbol     *s;
   const char *binary;
   Symbol     sym = { 0, address, 0, 0, 0, 0, -1 };
-  IgHookTrace::symbol(address, sym.name, binary, sym.symoffset, sym.binoffset);
+  if ((sym.name = igprof_synthetic_name(address)))
+    binary = 0;
+  else if (! IgHookTrace::symbol(address, sym.name, binary, sym.symoffset, sym.binoffset))
+  {
+    // Not in any loaded object, maybe code generated by a JIT.
+    if (JitSymbol *jit = jitSymbolForAddress(address))
+    {
+      sym.name = jit->name;
+      sym.symoffset = (char *) address - jit->start;
+    }
+  }
 
   // Hook up the cache entry to sort order in the hash list.
   SymCache *next = *sclink;
@@ -111,6 +231,153 @@ IgProfSymCache::roundAddressToSymbol(void *address)
   return cached->symaddr;
 }
 
+/** Record a function of @a size bytes of code at @a start named by
+    the @a len characters at @a name.  */
+void
+IgProfSymCache::addJitSymbol(uint64_t start, uint64_t size,
+                             const char *name, size_t len)
+{
+  if (! size || ! len || len >= 4096)
+    return;
+
+  // Keep the name and the symbols aligned in the pool.
+  char *copy = (char *) allocateSpace((len + 8) & ~(size_t) 7);
+  memcpy(copy, name, len);
+  copy[len] = 0;
+
+  JitSymbol *jit = allocate<JitSymbol>();
+  jit->next = jitlist_;
+  jit->start = (char *) (uintptr_t) start;
+  jit->size = size;
+  jit->name = copy;
+  jit->order = njitsyms_++;
+  jitlist_ = jit;
+}
+
+/** Read a perf map file, which has one "START SIZE NAME" line of
+    hexadecimal start address and size per generated function.  */
+void
+IgProfSymCache::loadPerfMap(const char *data, size_t size)
+{
+  const char *p = data, *end = data + size;
+  while (p < end)
+  {
+    const char *eol = (const char *) memchr(p, '\n', end - p);
+    if (! eol)
+      eol = end;
+
+    uint64_t start = parseHex(p, eol);
+    if (p < eol && *p == ' ')
+    {
+      uint64_t len = parseHex(++p, eol);
+      if (p < eol && *p == ' ')
+        addJitSymbol(start, len, p + 1, eol - p - 1);
+    }
+
+    p = eol + 1;
+  }
+}
+
+/** Read the code load records of a jitdump file.  Other records, such
+    as code moves and debug information, are ignored.  */
+void
+IgProfSymCache::loadJitDump(const char *data, size_t size)
+{
+  // File header: magic, version, header size, machine, padding, pid,
+  // timestamp and flags.  Only native byte order is understood.
+  uint32_t magic, hdrsize;
+  if (size < 40)
+    return;
+  memcpy(&magic, data, 4);
+  memcpy(&hdrsize, data + 8, 4);
+  if (magic != 0x4A695444 || hdrsize < 40)
+    return;
+
+  // Records: id, total size and timestamp, followed by the body.  Code
+  // loads have pid, tid, vma, code address, code size and code index,
+  // then the null-terminated function name and the code.
+  size_t pos = hdrsize;
+  while (pos + 16 <= size)
+  {
+    uint32_t id, recsize;
+    memcpy(&id, data + pos, 4);
+    memcpy(&recsize, data + pos + 4, 4);
+    if (recsize < 16 || recsize > size - pos)
+      break;
+
+    if (id == 0 && recsize > 56)
+    {
+      const char *body = data + pos + 16;
+      const char *name = body + 40;
+      const char *nameend = (const char *) memchr(name, 0, data + pos + recsize - name);
+      uint64_t start, len;
+      memcpy(&start, body + 16, 8);
+      memcpy(&len, body + 24, 8);
+      if (nameend)
+        addJitSymbol(start, len, name, nameend - name);
+    }
+
+    pos += recsize;
+  }
+}
+
+/** Read the symbols of dynamically generated code which just-in-time
+    compilers describe for perf in "/tmp/perf-PID.map" and in a jitdump
+    file "jit-PID.dump", and sort them by address.  */
+void
+IgProfSymCache::loadJitSymbols(void)
+{
+  char         path[1024];
+  const char   *data;
+  size_t       size;
+
+  jitloaded_ = true;
+  snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long) getpid());
+  if ((data = mapFile(path, size)))
+  {
+    loadPerfMap(data, size);
+    munmap((void *) data, size);
+  }
+
+  if (findJitDump(path, sizeof(path)) && (data = mapFile(path, size)))
+  {
+    loadJitDump(data, size);
+    munmap((void *) data, size);
+  }
+
+  if (! njitsyms_)
+    return;
+
+  // Functions later in the load order win if code memory was reused.
+  jitsyms_ = (JitSymbol **) allocateRaw(njitsyms_ * sizeof(JitSymbol *));
+  size_t i = 0;
+  for (JitSymbol *jit = jitlist_; jit; jit = jit->next)
+    jitsyms_[i++] = jit;
+  std::sort(jitsyms_, jitsyms_ + njitsyms_, jitSymbolBefore);
+}
+
+/** Get the JIT symbol covering an address if there is one.  */
+IgProfSymCache::JitSymbol *
+IgProfSymCache::jitSymbolForAddress(void *address)
+{
+  if (! jitloaded_)
+    loadJitSymbols();
+
+  // Find the last function starting at or before the address.
+  size_t lo = 0, hi = njitsyms_;
+  while (jitsyms_ && lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (jitsyms_[mid]->start <= (char *) address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  JitSymbol *jit = lo && jitsyms_ ? jitsyms_[lo-1] : 0;
+  return jit && (char *) address < jit->start + jit->size ? jit : 0;
+}
+
 /** Return a symbol definition for an address. */
 IgProfSymCache::Symbol *
 IgProfSymCache::get(void *address)
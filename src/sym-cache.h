@@ -37,6 +37,16 @@ public:
     int         id;             //< Reference ID in final output, -1 if unset.
   };
 
+  /// Function in dynamically generated code, as described by a JIT.
+  struct JitSymbol
+  {
+    JitSymbol   *next;          //< The previously loaded symbol.
+    size_t      order;          //< Position in the load order.
+    char        *start;         //< Start address of the function code.
+    size_t      size;           //< Size of the function code in bytes.
+    const char  *name;          //< Name of the function.
+  };
+
   /// Hash table cache entry for call address to symbol address mappings.
   struct SymCache
   {
@@ -53,10 +63,20 @@ public:
 private:
   void *        roundAddressToSymbol(void *address);
   Symbol *      symbolForAddress(void *address);
+  JitSymbol *   jitSymbolForAddress(void *address);
+  void          loadJitSymbols(void);
+  void          loadPerfMap(const char *data, size_t size);
+  void          loadJitDump(const char *data, size_t size);
+  void          addJitSymbol(uint64_t start, uint64_t size,
+                             const char *name, size_t len);
 
   Binary        *bintable_[BINARY_HASH]; //< The binaries hash.
   Symbol        *symtable_[SYMBOL_HASH]; //< The symbol hash.
   SymCache      *symcache_[SYMBOL_HASH]; //< The symbol cache hash.
+  JitSymbol     *jitlist_;               //< JIT symbols in load order.
+  JitSymbol     **jitsyms_;              //< JIT symbols sorted by address.
+  size_t        njitsyms_;               //< Number of JIT symbols.
+  bool          jitloaded_;              //< Whether JIT symbols were read.
 
   // Unavailable copy constructor, assignment operator
   IgProfSymCache(IgProfSymCache &);
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #if __linux
+# include <link.h>
 # include <execinfo.h>
 # include <ucontext.h>
 # include <sys/syscall.h>
@@ -66,8 +67,23 @@ IgHookTrace::tosymbol(void *address)
     ? info.dli_saddr : address;
 }
 
-int
-IgHookTrace::stacktrace(void **addresses, int nmax)
+/** An interpreter loop function and the unwinder for its frames. */
+struct HIDDEN IgHookUnwinder
+{
+  char                  *start;         //< Start of the function code.
+  char                  *end;           //< End of the function code.
+  IgHookTrace::Unwinder *unwind;        //< Unwinder for its frames.
+};
+
+static const int        MAX_UNWINDERS   = 8;
+static IgHookUnwinder   s_unwinders[MAX_UNWINDERS];
+static int              s_nunwinders    = 0;
+
+/** Walk the native call stack of the calling function into @a
+    addresses, at most @a nmax frames.  Inlined into the caller so
+    that the frames seen are the same as the caller's own.  */
+static inline __attribute__((always_inline)) int
+walkStack(void **addresses, int nmax)
 {
 #if __linux && __i386__
   // Safer assumption for the VSYSCALL_PAGE.
@@ -172,7 +188,20 @@ IgHookTrace::stacktrace(void **addresses, int nmax)
 
   return depth;
 #elif __linux && (__x86_64__ || __arm__ || __aarch64__)
-  return unw_backtrace(addresses, nmax);
+  // unw_backtrace() starts at its caller, which is stacktrace() itself
+  // unless the compiler made the call a tail call.  Drop the frames up
+  // to the caller of stacktrace().  This relies on walkStack() being
+  // inlined into stacktrace(), so the return address below is that of
+  // stacktrace(); if it is not found the trace is kept as is.
+  void *caller = __builtin_return_address(0);
+  int depth = unw_backtrace(addresses, nmax);
+  for (int skip = 1; skip < depth && skip < 3; ++skip)
+    if (addresses[skip] == caller)
+    {
+      memmove(addresses, addresses+skip, (depth -= skip) * sizeof(void *));
+      break;
+    }
+  return depth;
 #if 0 // Debug code for tracking unwind failures.
   if (addresses[depth-1] != (void *) 0x40cce9)
   {
@@ -234,3 +263,81 @@ IgHookTrace::stacktrace(void **addresses, int nmax)
   return 0;
 #endif
 }
+
+/** Register @a unwind for the frames of the interpreter loop
+    @a function, which must be the start of a function in a loaded
+    object.  Returns false if the function size cannot be determined
+    or there are too many unwinders.  Must be called before
+    profiling starts.  */
+bool
+IgHookTrace::addUnwinder(void *function, Unwinder *unwind)
+{
+#if __linux
+  Dl_info info;
+  const ElfW(Sym) *sym = 0;
+  if (s_nunwinders == MAX_UNWINDERS
+      || ! dladdr1(function, &info, (void **) &sym, RTLD_DL_SYMENT)
+      || ! sym || ! sym->st_size || info.dli_saddr != function)
+    return false;
+
+  IgHookUnwinder &u = s_unwinders[s_nunwinders];
+  u.start = (char *) function;
+  u.end = (char *) function + sym->st_size;
+  u.unwind = unwind;
+  __atomic_store_n(&s_nunwinders, s_nunwinders+1, __ATOMIC_RELEASE);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/** Replace the native frames of registered interpreter loops in the
+    stack trace of @a depth frames in @a addresses with the frames of
+    the interpreted code they run, as returned by the unwinders.  The
+    unwinders are called leaf first for each interpreter loop frame,
+    each with its own state, initially null.  Frames which the
+    unwinder cannot replace are kept.  Returns the new depth, at most
+    @a nmax.  */
+static int
+unwindInterpreters(void **addresses, int depth, int nmax)
+{
+  void *state[MAX_UNWINDERS] = { 0 };
+  void *frames[64];
+  int   n = __atomic_load_n(&s_nunwinders, __ATOMIC_ACQUIRE);
+
+  for (int i = 0; i < depth; ++i)
+    for (int u = 0; u < n; ++u)
+      if ((char *) addresses[i] >= s_unwinders[u].start
+          && (char *) addresses[i] < s_unwinders[u].end)
+      {
+        int nframes = s_unwinders[u].unwind(&state[u], frames, 64);
+        if (nframes <= 0)
+          break;
+
+        // Make room for the frames, dropping the outermost ones if full.
+        int keep = depth - i - 1;
+        if (i + nframes + keep > nmax)
+          keep = nmax - i - nframes;
+        if (keep < 0)
+        {
+          keep = 0;
+          nframes = nmax - i;
+        }
+        memmove(&addresses[i+nframes], &addresses[i+1], keep * sizeof(void *));
+        memcpy(&addresses[i], frames, nframes * sizeof(void *));
+        depth = i + nframes + keep;
+        i += nframes - 1;
+        break;
+      }
+
+  return depth;
+}
+
+int
+IgHookTrace::stacktrace(void **addresses, int nmax)
+{
+  int depth = walkStack(addresses, nmax);
+  if (UNLIKELY(s_nunwinders))
+    depth = unwindInterpreters(addresses, depth, nmax);
+  return depth;
+}
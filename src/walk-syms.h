@@ -6,7 +6,17 @@
 class HIDDEN IgHookTrace
 {
 public:
+  /** Unwinder for the frames of an interpreter.  Called from the stack
+      walk for each native frame of the interpreter loop, leaf first.
+      Stores up to @a maxframes stack frame addresses of the interpreted
+      code run by that loop frame into @a frames, leaf first, and
+      returns their number.  @a state is null on the first call of a
+      stack walk and is kept across the calls.  Runs in signal
+      handlers, so must be async signal safe.  */
+  typedef int         Unwinder(void **state, void **frames, int maxframes);
+
   static int          stacktrace(void **addresses, int nmax);
+  static bool         addUnwinder(void *function, Unwinder *unwind);
   static void *       tosymbol(void *address);
   static bool         symbol(void *address, const char *&sym,
 			     const char *&lib, long &offset,